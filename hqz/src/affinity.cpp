@@ -0,0 +1,115 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+#ifdef __linux__
+
+struct CpuOrder {
+    // Sort key: n-th CPU of its socket, then socket
+    int rank;
+    int socket;
+    int cpu;
+
+    bool operator< (const CpuOrder &o) const {
+        return rank != o.rank ? rank < o.rank : socket != o.socket ? socket < o.socket : cpu < o.cpu;
+    }
+};
+
+static int socketOf(int cpu)
+{
+    char path[96];
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+
+    int socket = 0;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d", &socket) != 1)
+            socket = 0;
+        fclose(f);
+    }
+    return socket;
+}
+
+#endif
+
+Affinity::Affinity()
+{
+#ifdef __linux__
+    if (!getenv("HQZ_PIN"))
+        return;
+
+    // Only the CPUs we're allowed to run on, e.g. under taskset or a cgroup
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed))
+        return;
+
+    std::vector<CpuOrder> order;
+    std::vector<int> perSocket;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        CpuOrder o;
+        o.socket = socketOf(cpu);
+        o.cpu = cpu;
+        if (o.socket < 0)
+            o.socket = 0;
+        if (unsigned(o.socket) >= perSocket.size())
+            perSocket.resize(o.socket + 1);
+        o.rank = perSocket[o.socket]++;
+        order.push_back(o);
+    }
+
+    std::sort(order.begin(), order.end());
+    for (unsigned i = 0; i < order.size(); ++i)
+        mCpus.push_back(order[i].cpu);
+#endif
+}
+
+void Affinity::pin(unsigned worker) const
+{
+#ifdef __linux__
+    if (mCpus.empty())
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(mCpus[worker % mCpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+#endif
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include <vector>
+
+
+/**
+ * Spreading worker threads over the machine's CPUs.
+ *
+ * pin(i) binds the calling thread to one CPU. Consecutive workers alternate
+ * between sockets, so a farm with fewer workers than CPUs still gets every
+ * socket's caches and memory bandwidth. Memory is placed on the NUMA node of
+ * the thread that first touches it, so each worker's histogram ends up next
+ * to the worker that draws into it, as long as the worker allocates it after
+ * pinning. Per-worker histograms are only summed once they're finished.
+ *
+ * Pinning is off unless the HQZ_PIN environment variable is set. Two pinned
+ * processes on one machine would fight over the same CPUs, so it's for
+ * dedicated render nodes running one hqz at a time.
+ */
+
+class Affinity {
+public:
+    Affinity();
+
+    bool enabled() const { return !mCpus.empty(); }
+    void pin(unsigned worker) const;
+
+private:
+    std::vector<int> mCpus;     // In the order workers get them
+};
@@ -0,0 +1,111 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+
+/**
+ * Walker's alias method, for picking from a fixed discrete distribution in
+ * constant time with a single uniform random number. Built with Vose's
+ * algorithm, which is numerically stable and linear in the number of weights.
+ */
+
+class AliasTable
+{
+public:
+    bool empty() const { return mEntries.empty(); }
+    unsigned size() const { return mEntries.size(); }
+
+    // Weights must be non-negative, with a positive sum.
+    void build(const std::vector<double> &weights)
+    {
+        unsigned n = weights.size();
+        double total = 0;
+        for (unsigned i = 0; i < n; ++i)
+            total += weights[i];
+
+        mEntries.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+
+        for (unsigned i = 0; i < n; ++i) {
+            scaled[i] = weights[i] * n / total;
+            if (scaled[i] < 1.0)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+
+        // Pair each underfull bucket with an overfull one that tops it up.
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back();
+            uint32_t l = large.back();
+            small.pop_back();
+
+            mEntries[s].probability = scaled[s];
+            mEntries[s].alias = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // Whatever is left over is full, up to rounding error.
+        for (unsigned i = 0; i < large.size(); ++i) {
+            mEntries[large[i]].probability = 1.0;
+            mEntries[large[i]].alias = large[i];
+        }
+        for (unsigned i = 0; i < small.size(); ++i) {
+            mEntries[small[i]].probability = 1.0;
+            mEntries[small[i]].alias = small[i];
+        }
+    }
+
+    // 'uniform' is in [0, 1). Its integer part picks a bucket, the fraction picks within it.
+    unsigned __attribute__((always_inline)) sample(double uniform) const
+    {
+        unsigned n = mEntries.size();
+        double x = uniform * n;
+        unsigned i = std::min<unsigned>(x, n - 1);
+        const Entry &e = mEntries[i];
+        return (x - i) < e.probability ? i : e.alias;
+    }
+
+private:
+    struct Entry {
+        double probability;
+        uint32_t alias;
+    };
+
+    std::vector<Entry> mEntries;
+};
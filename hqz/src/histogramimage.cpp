@@ -41,6 +41,32 @@ void HistogramImage::resize(unsigned w, unsigned h)
 void HistogramImage::clear()
 {
     memset(&mCounts[0], 0, mCounts.size() * sizeof mCounts[0]);
+    memset(&mCounters, 0, sizeof mCounters);
+}
+
+void HistogramImage::add(const HistogramImage &other)
+{
+    for (size_t i = 0, e = std::min(mCounts.size(), other.mCounts.size()); i != e; ++i)
+        mCounts[i] += other.mCounts[i];
+}
+
+uint64_t HistogramImage::hash() const
+{
+    /*
+     * FNV-1a, one 64-bit word at a time. XOR and multiplication by an odd
+     * constant are both invertible, so changing any single count always
+     * changes the result.
+     */
+
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    h = (h ^ mWidth) * prime;
+    h = (h ^ mHeight) * prime;
+    for (size_t i = 0, e = mCounts.size(); i != e; ++i)
+        h = (h ^ uint64_t(mCounts[i])) * prime;
+
+    return h;
 }
 
 void HistogramImage::render(std::vector<unsigned char> &rgb, double scale, double exponent)
@@ -74,6 +100,8 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
      *   We scale the brightness of each pixel to compensate.
      */
 
+    HQZ_COUNT(mCounters.lines);
+
     unsigned hx = kChannels;
     unsigned hy = kChannels * mWidth;
     double limitX = mWidth - 1.0001;
@@ -167,6 +195,8 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
     if (isnan(x1)) return;
     if (isnan(y1)) return;
 
+    HQZ_COUNT(mCounters.rasterized);
+
     // First endpoint
 
     double x05 = x0 + 0.5;
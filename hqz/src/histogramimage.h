@@ -31,6 +31,8 @@
 #include <vector>
 #include <algorithm>
 #include "spectrum.h"
+#include "counters.h"
+#include "hugepages.h"
 
 
 class HistogramImage
@@ -38,14 +40,32 @@ class HistogramImage
 public:
     void resize(unsigned w, unsigned h);
     void clear();
+    void add(const HistogramImage &other);      // Same size; sums the counts
     void render(std::vector<unsigned char> &rgb, double scale, double exponent);
     void line(Color color, double x0, double y0, double x1, double y1);
 
     unsigned width() const { return mWidth; }
     unsigned height() const { return mHeight; }
 
+    // Raw sample counts, 'channels' interleaved values per pixel.
+    const int64_t *counts() const { return &mCounts[0]; }
+    size_t size() const { return mCounts.size(); }
+    static unsigned channels() { return kChannels; }
+
+    // Fingerprint of the dimensions and every raw count. Any change alters it.
+    uint64_t hash() const;
+
+    // Calls to line(), and how many of those drew anything. Only with HQZ_STATS.
+    struct Counters {
+        uint64_t lines;
+        uint64_t rasterized;
+    };
+
+    const Counters &counters() const { return mCounters; }
+
 private:
     static const unsigned kChannels = 3;
     uint32_t mWidth, mHeight;
-    std::vector<int64_t> mCounts;
+    std::vector<int64_t, HugePageAllocator<int64_t> > mCounts;
+    Counters mCounters;
 };
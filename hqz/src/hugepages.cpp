@@ -0,0 +1,96 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "hugepages.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+static void outOfMemory()
+{
+    // Like std::allocator without exceptions
+    fprintf(stderr, "Out of memory\n");
+    abort();
+}
+
+void *HugePages::allocate(size_t bytes)
+{
+#ifdef __linux__
+    if (bytes >= kSize) {
+        size_t length = (bytes + kSize - 1) & ~(kSize - 1);
+
+#ifdef MAP_HUGETLB
+        void *p = mmap(0, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            return p;
+#endif
+
+        // Over-allocate, then trim to a 2 MB-aligned block of exactly 'length'
+        char *base = (char*) mmap(0, length + kSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            outOfMemory();
+
+        char *aligned = (char*) ((uintptr_t(base) + kSize - 1) & ~uintptr_t(kSize - 1));
+        size_t head = aligned - base;
+        if (head)
+            munmap(base, head);
+        munmap(aligned + length, kSize - head);
+
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+        return aligned;
+    }
+#endif
+
+    void *p = malloc(bytes ? bytes : 1);
+    if (!p)
+        outOfMemory();
+    return p;
+}
+
+void HugePages::release(void *p, size_t bytes)
+{
+    if (!p)
+        return;
+
+#ifdef __linux__
+    if (bytes >= kSize) {
+        munmap(p, (bytes + kSize - 1) & ~(kSize - 1));
+        return;
+    }
+#endif
+
+    free(p);
+}
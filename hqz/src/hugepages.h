@@ -0,0 +1,78 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include <stddef.h>
+#include <memory>
+
+
+/**
+ * Memory for large, randomly accessed arrays, backed by huge pages.
+ *
+ * Histogram writes land all over a frame, so with 4 KB pages nearly every
+ * write misses the TLB. With 2 MB pages a 4K frame's histogram needs about a
+ * hundred TLB entries instead of fifty thousand.
+ *
+ * Blocks of at least kSize bytes first try explicit huge pages (MAP_HUGETLB),
+ * which only works if the administrator reserved some, for example with
+ * "sysctl vm.nr_hugepages=512". Otherwise we map 2 MB-aligned memory and ask
+ * for transparent huge pages with madvise(). Smaller blocks, and platforms
+ * without either, use ordinary memory.
+ *
+ * The memory is mapped, not touched, so its pages are placed on the NUMA node
+ * of whichever thread writes them first. See affinity.h.
+ */
+
+namespace HugePages
+{
+    static const size_t kSize = 2 << 20;
+
+    void *allocate(size_t bytes);
+    void release(void *p, size_t bytes);
+}
+
+
+// For std::vector
+template <typename T>
+struct HugePageAllocator : public std::allocator<T>
+{
+    template <typename U> struct rebind { typedef HugePageAllocator<U> other; };
+
+    HugePageAllocator() {}
+    template <typename U> HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T *allocate(size_t n, const void * = 0)
+    {
+        return static_cast<T*>(HugePages::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        HugePages::release(p, n * sizeof(T));
+    }
+};
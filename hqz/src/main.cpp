@@ -26,13 +26,24 @@
  */
 
 #include "rapidjson/document.h"
-#include "rapidjson/reader.h"
-#include "rapidjson/filestream.h"
 #include "lodepng.h"
+#include "scenefile.h"
+#include "zbinary.h"
 #include "zrender.h"
+#include "zserver.h"
+#include "zbench.h"
+#include "zfarm.h"
+#include "zcache.h"
+#include "timer.h"
+#include "counters.h"
 #include <signal.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <cstdio>
+#include <sstream>
 #include <vector>
 
 static ZRender *interruptibleRenderer = 0;
@@ -52,50 +63,328 @@ void handleSigint(int)
     }
 }
 
-int main(int argc, char **argv)
+static int usage()
+{
+    fprintf(stderr,
+        "\n"
+        "High Quality Zen: The batch renderer for Zen photon garden\n"
+        "\n"
+        "usage: hqz [--stats] [--heatmap <heatmap.png>] [--progress-fd <fd>]\n"
+        "           [--cache <directory>] <scene.json> <output.png>\n"
+        "       hqz --convert <input> <output>\n"
+        "       hqz --serve <socket> [job slots [cache directory]]\n"
+        "       hqz --jobs <N> <animation.json | spool directory> <output directory>\n"
+        "       hqz --bench [scene directory]\n"
+        "       hqz --regress <baseline.json> [scene directory [percent]]\n"
+        "\n"
+        "  Scenes may be JSON, or the compact binary format written by\n"
+        "  --convert. Converting JSON produces binary, and vice versa.\n"
+        "  Any file may be \"-\" for stdin/stdout.\n"
+        "\n"
+        "  With --stats, the render report is printed as JSON. Builds made\n"
+        "  with \"make STATS=1\" add hot-path counters to it.\n"
+        "\n"
+        "  With --heatmap, hqz also writes an image of where rendering time\n"
+        "  goes: each ray segment, brightened by the number of objects tested\n"
+        "  to find its end.\n"
+        "\n"
+        "  With --progress-fd, hqz writes a line of JSON to the given file\n"
+        "  descriptor every second while tracing: rays so far, percent of\n"
+        "  the ray or time budget, rays per second, ETA, and memory use.\n"
+        "\n"
+        "  With --cache, finished frames are kept in a directory, named by a\n"
+        "  hash of the scene and the renderer version. A scene that's already\n"
+        "  there is copied to the output instead of being rendered again.\n"
+        "\n"
+        "  With --serve, hqz stays running and renders jobs sent over a\n"
+        "  Unix socket. By default there is one job slot per CPU. Images\n"
+        "  and histograms are cached if a cache directory is given.\n"
+        "\n"
+        "  With --jobs, hqz renders many frames with N workers (0 for one\n"
+        "  per CPU): each line of an animation file, or each scene file in\n"
+        "  a spool directory. Frames are written as PNGs to the output\n"
+        "  directory, along with a log in farm.log.\n"
+        "\n"
+        "  With --bench, hqz renders the standard benchmark scenes (from\n"
+        "  \"bench\" by default) and prints the results as JSON.\n"
+        "  --regress also compares them with an earlier --bench result.\n"
+        "  It fails if any image changed, or if throughput dropped by more\n"
+        "  than 'percent' (default 10).\n"
+        "\n"
+        "Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>\n"
+        "https://github.com/scanlime/zenphoton\n"
+        "\n");
+    return 1;
+}
+
+static bool loadScene(SceneFile &sceneFile, const char *path)
 {
-    if (argc != 3) {
-        fprintf(stderr,
-            "\n"
-            "High Quality Zen: The batch renderer for Zen photon garden\n"
-            "\n"
-            "usage: hqz <scene.json> <output.png>\n"
-            "  (Either may be \"-\" for stdin/stdout)\n"
-            "\n"
-            "Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>\n"
-            "https://github.com/scanlime/zenphoton\n"
-            "\n");
-        return 1;
-    }
-
-    FILE *sceneF = argv[1][0] == '-' ? stdin : fopen(argv[1], "r");
+    FILE *sceneF = path[0] == '-' ? stdin : fopen(path, "r");
     if (!sceneF) {
         perror("Error opening scene file");
+        return false;
+    }
+
+    if (!sceneFile.load(sceneF)) {
+        perror("Error reading scene file");
+        return false;
+    }
+
+    if (sceneF != stdin)
+        fclose(sceneF);
+    return true;
+}
+
+static int convert(const char *inputPath, const char *outputPath)
+{
+    SceneFile sceneFile;
+    if (!loadScene(sceneFile, inputPath))
         return 2;
+
+    FILE *outputF = outputPath[0] == '-' ? stdout : fopen(outputPath, "wb");
+    if (!outputF) {
+        perror("Error opening output file");
+        return 3;
+    }
+
+    if (sceneFile.hasError()) {
+        fprintf(stderr, "%s", sceneFile.errorText());
+        return 4;
+    }
+
+    if (sceneFile.isBinary()) {
+        ZBinary::writeJSON(sceneFile.document(), outputF);
+
+    } else {
+        std::ostringstream err;
+        std::vector<char> bin;
+
+        if (!ZBinary::encode(sceneFile.document(), bin, err)) {
+            fprintf(stderr, "Conversion errors:\n%s", err.str().c_str());
+            return 5;
+        }
+
+        if (1 != fwrite(&bin[0], bin.size(), 1, outputF)) {
+            perror("Error writing output file");
+            return 6;
+        }
+    }
+
+    if (fflush(outputF)) {
+        perror("Error writing output file");
+        return 6;
+    }
+
+    return 0;
+}
+
+static void report(const ZRender &zr, double parseTime, double encodeTime, double totalTime)
+{
+    // Summarize throughput and per-phase wall time on stderr.
+
+    const ZRender::Stats &stats = zr.stats();
+    double traceTime = std::max(stats.traceTime, 1e-9);
+
+    fprintf(stderr,
+        "Traced %llu rays, %llu segments in %.3f s (%.0f rays/s, %.0f segments/s)\n"
+        "Time: parse %.3f s, build %.3f s, trace %.3f s, tone map %.3f s, encode %.3f s, total %.3f s\n",
+        (unsigned long long) stats.rays, (unsigned long long) stats.segments, stats.traceTime,
+        stats.rays / traceTime, stats.segments / traceTime,
+        parseTime, stats.buildTime, stats.traceTime, stats.toneMapTime, encodeTime, totalTime);
+
+    if (stats.noiseRounds) {
+        fprintf(stderr, "Noise: %.4f (95th percentile tile error over %u rounds)\n",
+            stats.noise, stats.noiseRounds);
+    }
+
+    const ZQuadtree::Report &tree = stats.quadtree;
+    fprintf(stderr, "Quadtree: %u nodes, depth %u, %u leaves of up to %u objects, "
+        "%u objects in inner nodes (%u unbounded), cost %.1f tests per ray vs %u without a tree\n",
+        tree.nodes, tree.depth, tree.leaves, tree.maxLeafObjects,
+        tree.innerObjects, tree.unboundedObjects, tree.sahCost, tree.objects);
+
+    if (stats.bounceLimitHits || stats.rouletteKills) {
+        fprintf(stderr, "Paths: %llu hit the bounce limit (%.3f%%), %llu ended by Russian roulette (%.3f%%)\n",
+            (unsigned long long) stats.bounceLimitHits, 100.0 * stats.bounceLimitHits / std::max<uint64_t>(stats.rays, 1),
+            (unsigned long long) stats.rouletteKills, 100.0 * stats.rouletteKills / std::max<uint64_t>(stats.rays, 1));
+    }
+}
+
+static void reportJSON(const ZRender &zr, double parseTime, double encodeTime, double totalTime)
+{
+    /*
+     * The same report as a JSON object on stderr, plus the hot-path counters if
+     * they were compiled in. Otherwise "counters" is null.
+     */
+
+    const ZRender::Stats &stats = zr.stats();
+    const ZRender::Stats::Counters &c = stats.counters;
+    double traceTime = std::max(stats.traceTime, 1e-9);
+
+    fprintf(stderr,
+        "{\n"
+        "  \"rays\": %llu, \"segments\": %llu, \"raysPerSecond\": %.0f, \"segmentsPerSecond\": %.0f,\n"
+        "  \"seconds\": {\"parse\": %.6f, \"build\": %.6f, \"trace\": %.6f, "
+        "\"toneMap\": %.6f, \"encode\": %.6f, \"total\": %.6f},\n"
+        "  \"paths\": {\"bounceLimit\": %llu, \"roulette\": %llu},\n",
+        (unsigned long long) stats.rays, (unsigned long long) stats.segments,
+        stats.rays / traceTime, stats.segments / traceTime,
+        parseTime, stats.buildTime, stats.traceTime, stats.toneMapTime, encodeTime, totalTime,
+        (unsigned long long) stats.bounceLimitHits, (unsigned long long) stats.rouletteKills);
+
+    if (stats.noiseRounds) {
+        fprintf(stderr, "  \"noise\": {\"error\": %.6f, \"rounds\": %u},\n",
+            stats.noise, stats.noiseRounds);
+    }
+
+    const ZQuadtree::Report &tree = stats.quadtree;
+    fprintf(stderr,
+        "  \"quadtree\": {\"objects\": %u, \"nodes\": %u, \"leaves\": %u, \"depth\": %u,\n"
+        "    \"maxLeafObjects\": %u, \"innerObjects\": %u, \"unboundedObjects\": %u, \"sahCost\": %.3f,\n"
+        "    \"leafSizes\": [",
+        tree.objects, tree.nodes, tree.leaves, tree.depth,
+        tree.maxLeafObjects, tree.innerObjects, tree.unboundedObjects, tree.sahCost);
+
+    for (unsigned i = 0; i < ZQuadtree::Report::kLeafBuckets; ++i) {
+        unsigned min = i ? 1u << (i - 1) : 0;
+        unsigned max = (1u << i) - 1;
+
+        if (i + 1 == ZQuadtree::Report::kLeafBuckets) {
+            fprintf(stderr, "%s\n      {\"min\": %u, \"max\": null, \"leaves\": %u}",
+                i ? "," : "", min, tree.leafSizes[i]);
+        } else {
+            fprintf(stderr, "%s\n      {\"min\": %u, \"max\": %u, \"leaves\": %u}",
+                i ? "," : "", min, max, tree.leafSizes[i]);
+        }
+    }
+
+    fprintf(stderr, "\n    ]\n  },\n");
+
+    if (!HQZ_STATS_ENABLED) {
+        fprintf(stderr, "  \"counters\": null\n}\n");
+        return;
+    }
+
+    fprintf(stderr,
+        "  \"counters\": {\n"
+        "    \"raysEmitted\": %llu, \"raysRejected\": %llu,\n"
+        "    \"nodesVisited\": %llu, \"intersectionTests\": %llu, \"hits\": %llu,\n"
+        "    \"segmentsRasterized\": %llu, \"segmentsClipped\": %llu,\n"
+        "    \"bounces\": [",
+        (unsigned long long) c.raysEmitted, (unsigned long long) c.raysRejected,
+        (unsigned long long) c.nodesVisited, (unsigned long long) c.intersectionTests,
+        (unsigned long long) c.hits,
+        (unsigned long long) c.segmentsRasterized, (unsigned long long) c.segmentsClipped);
+
+    // Bounce histogram, up to the last bucket in use.
+    unsigned buckets = ZRender::Stats::Counters::kBounceBuckets;
+    while (buckets > 1 && !c.bounces[buckets - 1])
+        buckets--;
+
+    for (unsigned i = 0; i < buckets; ++i) {
+        unsigned long long min = i ? 1ULL << (i - 1) : 0;
+        unsigned long long max = (1ULL << i) - 1;
+
+        if (i + 1 == ZRender::Stats::Counters::kBounceBuckets) {
+            fprintf(stderr, "%s\n      {\"min\": %llu, \"max\": null, \"rays\": %llu}",
+                i ? "," : "", min, (unsigned long long) c.bounces[i]);
+        } else {
+            fprintf(stderr, "%s\n      {\"min\": %llu, \"max\": %llu, \"rays\": %llu}",
+                i ? "," : "", min, max, (unsigned long long) c.bounces[i]);
+        }
     }
 
-    FILE *outputF = argv[2][0] == '-' ? stdout : fopen(argv[2], "wb");
+    fprintf(stderr, "\n    ]\n  }\n}\n");
+}
+
+static bool writePNG(const char *path, const std::vector<unsigned char> &pixels, const ZRender &zr)
+{
+    FILE *f = path[0] == '-' ? stdout : fopen(path, "wb");
+    if (!f)
+        return false;
+
+    std::vector<unsigned char> png;
+    lodepng::encode(png, pixels, zr.width(), zr.height(), LCT_RGB);
+    bool ok = 1 == fwrite(&png[0], png.size(), 1, f);
+
+    if (f != stdout)
+        ok = !fclose(f) && ok;
+    return ok;
+}
+
+static int renderCached(ZCache &cache, uint64_t key, FILE *outputF, bool json, int progressFd)
+{
+    // Copy a cached frame to the output. Returns -1 on a cache miss.
+
+    std::vector<unsigned char> png;
+    if (!cache.load(key, "png", png))
+        return -1;
+
+    if (1 != fwrite(&png[0], png.size(), 1, outputF)) {
+        perror("Error writing output file");
+        return 6;
+    }
+
+    if (progressFd >= 0) {
+        signal(SIGPIPE, SIG_IGN);
+        ZProgress(progressFd).finish(0, 0);
+    }
+
+    if (json)
+        printf("{\"cached\": true, \"key\": \"%016llx\"}\n", (unsigned long long) key);
+    else
+        fprintf(stderr, "Copied cached frame %016llx\n", (unsigned long long) key);
+    return 0;
+}
+
+static int render(const char *scenePath, const char *outputPath, bool json,
+    const char *heatmapPath, int progressFd, const char *cacheDir)
+{
+    Timer totalTimer;
+
+    SceneFile sceneFile;
+    if (!loadScene(sceneFile, scenePath))
+        return 2;
+    double parseTime = totalTimer.elapsed();
+
+    FILE *outputF = outputPath[0] == '-' ? stdout : fopen(outputPath, "wb");
     if (!outputF) {
         perror("Error opening output file");
         return 3;
     }
 
-    rapidjson::FileStream istr(sceneF);
-    rapidjson::Document scene;
-    scene.ParseStream<0>(istr);
-    if (scene.HasParseError()) {
-        fprintf(stderr, "Parse error at character %ld: %s\n",
-            scene.GetErrorOffset(), scene.GetParseError());
+    if (sceneFile.hasError()) {
+        fprintf(stderr, "%s", sceneFile.errorText());
         return 4;
     }
 
-    ZRender zr(scene);
+    // A heatmap can't come from the cache, so those renders skip it entirely.
+    ZCache cache(cacheDir ? cacheDir : "");
+    uint64_t cacheKey = 0;
+    if (cacheDir && !heatmapPath) {
+        cacheKey = ZCache::key(sceneFile.document());
+        int status = renderCached(cache, cacheKey, outputF, json, progressFd);
+        if (status >= 0)
+            return status;
+    }
+
+    ZRender zr(sceneFile.document());
     std::vector<unsigned char> pixels;
     if (zr.hasError()) {
         fprintf(stderr, "Scene errors:\n%s", zr.errorText());
         return 5;
     }
 
+    if (heatmapPath)
+        zr.enableHeatmap();
+
+    ZProgress progress(progressFd);
+    if (progressFd >= 0) {
+        // If the reader hangs up, keep rendering; ZProgress just stops writing.
+        signal(SIGPIPE, SIG_IGN);
+        zr.setProgress(&progress);
+    }
+
     // Render, and allow Ctrl-C to interrupt at any time.
     interruptibleRenderer = &zr;
     signal(SIGINT, handleSigint);
@@ -107,12 +396,90 @@ int main(int argc, char **argv)
         return 7;
     }
 
+    Timer encodeTimer;
     std::vector<unsigned char> png;
     lodepng::encode(png, pixels, zr.width(), zr.height(), LCT_RGB);
     if (1 != fwrite(&png[0], png.size(), 1, outputF)) {
         perror("Error writing output file");
         return 6;
     }
+    double encodeTime = encodeTimer.elapsed();
+
+    if (cacheDir && !heatmapPath && !cache.store(cacheKey, "png", &png[0], png.size()))
+        perror("Error writing to frame cache");
+
+    if (heatmapPath) {
+        zr.heatmap(pixels);
+        if (!writePNG(heatmapPath, pixels, zr)) {
+            perror("Error writing heatmap file");
+            return 6;
+        }
+    }
 
+    if (json)
+        reportJSON(zr, parseTime, encodeTime, totalTimer.elapsed());
+    else
+        report(zr, parseTime, encodeTime, totalTimer.elapsed());
     return 0;
 }
+
+static int serve(const char *path, const char *slotsArg, const char *cacheDir)
+{
+    // Zero slots means one per CPU, so a cache directory can follow the default
+    int slots = slotsArg ? atoi(slotsArg) : 0;
+    if (slots < 1)
+        slots = std::max<long>(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+    ZServer server(path, slots, cacheDir);
+    return server.run();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && !strcmp(argv[1], "--convert"))
+        return convert(argv[2], argv[3]);
+
+    if (argc >= 3 && argc <= 5 && !strcmp(argv[1], "--serve"))
+        return serve(argv[2], argc >= 4 ? argv[3] : 0, argc == 5 ? argv[4] : 0);
+
+    if (argc == 5 && !strcmp(argv[1], "--jobs"))
+        return ZFarm(argv[3], argv[4], std::max(0, atoi(argv[2]))).run();
+
+    if ((argc == 2 || argc == 3) && !strcmp(argv[1], "--bench"))
+        return ZBench(argc == 3 ? argv[2] : "bench").run(stdout);
+
+    if (argc >= 3 && argc <= 5 && !strcmp(argv[1], "--regress")) {
+        double threshold = argc == 5 ? atof(argv[4]) / 100.0 : 0.1;
+        return ZBench(argc >= 4 ? argv[3] : "bench").run(stdout, argv[2], threshold);
+    }
+
+    // Rendering, with options in any order before the scene
+    bool json = false;
+    const char *heatmapPath = 0;
+    int progressFd = -1;
+    const char *cacheDir = 0;
+    int arg = 1;
+
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] == '-'; ++arg) {
+        if (!strcmp(argv[arg], "--stats"))
+            json = true;
+        else if (!strcmp(argv[arg], "--heatmap") && arg + 1 < argc)
+            heatmapPath = argv[++arg];
+        else if (!strcmp(argv[arg], "--progress-fd") && arg + 1 < argc)
+            progressFd = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--cache") && arg + 1 < argc)
+            cacheDir = argv[++arg];
+        else
+            return usage();
+    }
+
+    if (progressFd >= 0 && fcntl(progressFd, F_GETFD) < 0) {
+        fprintf(stderr, "Progress file descriptor %d is not open\n", progressFd);
+        return 3;
+    }
+
+    if (argc - arg == 2)
+        return render(argv[arg], argv[arg + 1], json, heatmapPath, progressFd, cacheDir);
+
+    return usage();
+}
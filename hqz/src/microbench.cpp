@@ -0,0 +1,379 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Microbenchmarks for the renderer's innermost primitives.
+ *
+ * Each kernel runs over a table of precomputed inputs, chosen to resemble what
+ * it sees in real scenes, for long enough to get a stable time. Results are
+ * printed as nanoseconds per operation and millions of operations per second.
+ * Build and run with "make microbench".
+ *
+ * Kernels are called through a non-inlined function, one input at a time. That
+ * adds a call to every measurement, but stops the compiler from vectorizing
+ * across inputs, which the renderer never gets to do.
+ */
+
+#include "rapidjson/document.h"
+#include "ray.h"
+#include "prng.h"
+#include "spectrum.h"
+#include "histogramimage.h"
+#include "timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Inputs per table; small enough to stay in cache, large enough to defeat branch prediction.
+static const unsigned kInputs = 4096;
+
+// Minimum time per measurement, in seconds.
+static const double kMinTime = 0.25;
+
+// Results are folded into this, so the compiler can't discard the work.
+static volatile double sink;
+
+static PRNG rng;
+
+static double uniform(double a, double b)
+{
+    return rng.uniform(a, b);
+}
+
+static Ray randomRay(double x0, double y0, double x1, double y1)
+{
+    Ray r;
+    r.origin.x = uniform(x0, x1);
+    r.origin.y = uniform(y0, y1);
+    r.setAngle(uniform(0, 2 * M_PI));
+    return r;
+}
+
+template <typename Kernel>
+static void measure(const char *name, Kernel &kernel)
+{
+    /*
+     * Run the kernel in passes over all its inputs, doubling the number of passes
+     * until one measurement takes at least kMinTime.
+     */
+
+    unsigned passes = 1;
+    double elapsed;
+    double result = 0;
+
+    // Warm up caches and the branch predictor
+    for (unsigned i = 0; i < kInputs; ++i)
+        result += kernel(i);
+
+    for (;;) {
+        Timer timer;
+        for (unsigned p = 0; p < passes; ++p)
+            for (unsigned i = 0; i < kInputs; ++i)
+                result += kernel(i);
+        elapsed = timer.elapsed();
+
+        if (elapsed >= kMinTime)
+            break;
+        passes *= 2;
+    }
+
+    sink += result;
+
+    double ops = double(passes) * kInputs;
+    printf("%-36s %10.2f ns/op %10.2f Mop/s\n", name, elapsed * 1e9 / ops, ops / elapsed * 1e-6);
+}
+
+struct IntersectSegment {
+    std::vector<Ray> rays;
+    std::vector<Vec2> origins;
+    std::vector<Vec2> deltas;
+
+    IntersectSegment(double minLength, double maxLength)
+        : rays(kInputs), origins(kInputs), deltas(kInputs)
+    {
+        for (unsigned i = 0; i < kInputs; ++i) {
+            rays[i] = randomRay(0, 0, 1024, 576);
+            double angle = uniform(0, 2 * M_PI);
+            double length = uniform(minLength, maxLength);
+            origins[i].x = uniform(0, 1024);
+            origins[i].y = uniform(0, 576);
+            deltas[i].x = cos(angle) * length;
+            deltas[i].y = sin(angle) * length;
+        }
+    }
+
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        double distance, alpha;
+        return rays[i].intersectSegment(origins[i], deltas[i], distance, alpha) ? distance + alpha : 0;
+    }
+};
+
+struct IntersectAABB {
+    std::vector<Ray> rays;
+    std::vector<AABB> boxes;
+
+    IntersectAABB(bool inside)
+        : rays(kInputs), boxes(kInputs)
+    {
+        for (unsigned i = 0; i < kInputs; ++i) {
+            AABB &b = boxes[i];
+            b.left = uniform(0, 900);
+            b.top = uniform(0, 500);
+            b.right = b.left + uniform(1, 120);
+            b.bottom = b.top + uniform(1, 70);
+
+            if (inside)
+                rays[i] = randomRay(b.left, b.top, b.right, b.bottom);
+            else do
+                rays[i] = randomRay(0, 0, 1024, 576);
+            while (b.contains(rays[i].origin));
+        }
+    }
+};
+
+struct IntersectClosest : IntersectAABB {
+    IntersectClosest(bool inside) : IntersectAABB(inside) {}
+
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        double closest;
+        return rays[i].intersectAABB(boxes[i], closest) ? closest : 0;
+    }
+};
+
+struct IntersectPair : IntersectAABB {
+    IntersectPair(bool inside) : IntersectAABB(inside) {}
+
+    // One op is one box, like IntersectClosest.
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        if (i & 1)
+            return 0;
+        double closest[2];
+        unsigned hits = rays[i].intersectAABB(boxes[i], boxes[i + 1], closest);
+        return hits ? closest[0] + closest[1] : 0;
+    }
+};
+
+struct IntersectFurthest : IntersectAABB {
+    IntersectFurthest(bool inside) : IntersectAABB(inside) {}
+
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        return rays[i].intersectFurthestAABB(boxes[i]);
+    }
+};
+
+struct Line {
+    HistogramImage image;
+    std::vector<Color> colors;
+    std::vector<AABB> lines;
+
+    /*
+     * Lines have a random length in [minLength, maxLength], and a slope
+     * (minor over major axis) in [0, maxSlope]. Endpoints may land anywhere
+     * within 'margin' pixels of the image.
+     */
+
+    Line(double minLength, double maxLength, double maxSlope, bool steep, double margin)
+        : colors(kInputs), lines(kInputs)
+    {
+        image.resize(1024, 576);
+
+        for (unsigned i = 0; i < kInputs; ++i) {
+            colors[i].setWavelength(uniform(400, 700));
+
+            double length = uniform(minLength, maxLength);
+            double slope = uniform(-maxSlope, maxSlope);
+            double major = length / sqrt(1 + slope * slope);
+            if (uniform(0, 1) < 0.5)
+                major = -major;
+
+            AABB &l = lines[i];
+            l.left = uniform(-margin, 1024 + margin);
+            l.top = uniform(-margin, 576 + margin);
+            l.right = l.left + (steep ? major * slope : major);
+            l.bottom = l.top + (steep ? major : major * slope);
+        }
+    }
+
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        const AABB &l = lines[i];
+        image.line(colors[i], l.left, l.top, l.right, l.bottom);
+        return 0;
+    }
+};
+
+struct SetWavelength {
+    std::vector<double> wavelengths;
+
+    SetWavelength() : wavelengths(kInputs)
+    {
+        for (unsigned i = 0; i < kInputs; ++i)
+            wavelengths[i] = uniform(360, 780);
+    }
+
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        Color c;
+        c.setWavelength(wavelengths[i]);
+        return c.r + c.g + c.b;
+    }
+};
+
+struct BlackbodyWavelength {
+    std::vector<double> temperatures;
+    std::vector<double> uniforms;
+
+    BlackbodyWavelength() : temperatures(kInputs), uniforms(kInputs)
+    {
+        for (unsigned i = 0; i < kInputs; ++i) {
+            temperatures[i] = uniform(1500, 12000);
+            uniforms[i] = uniform(0, 1);
+        }
+    }
+
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        return Color::blackbodyWavelength(temperatures[i], uniforms[i]);
+    }
+};
+
+struct Uniform32 {
+    PRNG prng;
+
+    Uniform32() { prng.seed(1); }
+
+    double __attribute__((noinline)) operator() (unsigned)
+    {
+        return prng.uniform32();
+    }
+};
+
+struct Seed {
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        PRNG prng;
+        prng.seed(i);
+        return prng.uniform32();
+    }
+};
+
+struct SeedLanes {
+    PRNG lanes[PRNG::kLanes];
+
+    double __attribute__((noinline)) operator() (unsigned i)
+    {
+        // One op is one generator, like Seed.
+        if (i % PRNG::kLanes == 0)
+            PRNG::seedLanes(lanes, i);
+        return lanes[i % PRNG::kLanes].uniform32();
+    }
+};
+
+int main()
+{
+    rng.seed(12345);
+
+    {
+        IntersectSegment k(1, 20);
+        measure("Ray::intersectSegment short", k);
+    }
+    {
+        IntersectSegment k(200, 1000);
+        measure("Ray::intersectSegment long", k);
+    }
+    {
+        IntersectClosest k(false);
+        measure("Ray::intersectAABB outside", k);
+    }
+    {
+        IntersectClosest k(true);
+        measure("Ray::intersectAABB inside", k);
+    }
+    {
+        IntersectPair k(false);
+        measure("Ray::intersectAABB pair outside", k);
+    }
+    {
+        IntersectPair k(true);
+        measure("Ray::intersectAABB pair inside", k);
+    }
+    {
+        IntersectFurthest k(false);
+        measure("Ray::intersectFurthestAABB outside", k);
+    }
+    {
+        IntersectFurthest k(true);
+        measure("Ray::intersectFurthestAABB inside", k);
+    }
+    {
+        Line k(2, 20, 0.2, false, 0);
+        measure("HistogramImage::line short shallow", k);
+    }
+    {
+        Line k(2, 20, 0.2, true, 0);
+        measure("HistogramImage::line short steep", k);
+    }
+    {
+        Line k(300, 1000, 0.2, false, 0);
+        measure("HistogramImage::line long shallow", k);
+    }
+    {
+        Line k(300, 1000, 0.2, true, 0);
+        measure("HistogramImage::line long steep", k);
+    }
+    {
+        Line k(100, 1000, 1.0, false, 2000);
+        measure("HistogramImage::line mostly clipped", k);
+    }
+    {
+        SetWavelength k;
+        measure("Color::setWavelength", k);
+    }
+    {
+        BlackbodyWavelength k;
+        measure("Color::blackbodyWavelength", k);
+    }
+    {
+        Uniform32 k;
+        measure("PRNG::uniform32", k);
+    }
+    {
+        Seed k;
+        measure("PRNG::seed", k);
+    }
+    {
+        SeedLanes k;
+        measure("PRNG::seedLanes per generator", k);
+    }
+
+    return 0;
+}
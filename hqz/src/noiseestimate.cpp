@@ -0,0 +1,113 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <math.h>
+#include <algorithm>
+#include "noiseestimate.h"
+
+
+void NoiseEstimate::tileTotals(const HistogramImage &image, std::vector<double> &totals)
+{
+    // Sum of all channels in each tile, scanning the image in memory order.
+
+    unsigned width = image.width();
+    unsigned height = image.height();
+    unsigned channels = HistogramImage::channels();
+    unsigned tilesX = (width + kTileSize - 1) / kTileSize;
+    unsigned tilesY = (height + kTileSize - 1) / kTileSize;
+
+    totals.assign(tilesX * tilesY, 0.0);
+    const int64_t *p = image.counts();
+
+    for (unsigned y = 0; y < height; ++y) {
+        double *row = &totals[(y / kTileSize) * tilesX];
+
+        for (unsigned tx = 0; tx < tilesX; ++tx) {
+            unsigned n = std::min(kTileSize, width - tx * kTileSize) * channels;
+            int64_t sum = 0;
+            for (unsigned i = 0; i < n; ++i)
+                sum += p[i];
+            row[tx] += sum;
+            p += n;
+        }
+    }
+}
+
+void NoiseEstimate::begin(const HistogramImage &image)
+{
+    // Anything already in the image (like debug overlays) isn't part of the first round.
+
+    tileTotals(image, mPrevious);
+    mSum.assign(mPrevious.size(), 0.0);
+    mSumSquares.assign(mPrevious.size(), 0.0);
+    mRounds = 0;
+}
+
+void NoiseEstimate::addRound(const HistogramImage &image)
+{
+    tileTotals(image, mCurrent);
+
+    for (unsigned i = 0, e = mCurrent.size(); i != e; ++i) {
+        double amount = mCurrent[i] - mPrevious[i];
+        mSum[i] += amount;
+        mSumSquares[i] += amount * amount;
+    }
+
+    mPrevious.swap(mCurrent);
+    mRounds++;
+}
+
+double NoiseEstimate::error(double percentile)
+{
+    /*
+     * Relative standard error of each lit tile's total, using the sample variance
+     * of its per-round amounts. Returns zero if we can't estimate anything yet.
+     */
+
+    if (mRounds < 2)
+        return 0;
+
+    double n = mRounds;
+    mErrors.clear();
+
+    for (unsigned i = 0, e = mSum.size(); i != e; ++i) {
+        double mean = mSum[i] / n;
+        if (mean <= 0.0)
+            continue;
+
+        double variance = std::max(0.0, (mSumSquares[i] - mSum[i] * mean) / (n - 1.0));
+        mErrors.push_back(sqrt(variance / n) / mean);
+    }
+
+    if (mErrors.empty())
+        return 0;
+
+    std::vector<double>::iterator nth = mErrors.begin() + unsigned(percentile * (mErrors.size() - 1));
+    std::nth_element(mErrors.begin(), nth, mErrors.end());
+    return *nth;
+}
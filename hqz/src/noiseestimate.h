@@ -0,0 +1,66 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "histogramimage.h"
+
+
+/**
+ * Estimates the remaining noise in a HistogramImage while it renders.
+ *
+ * The image is split into square tiles. Each call to addRound() measures how much
+ * light every tile received since the previous call; if rounds are independent
+ * batches of rays, the spread of these per-round amounts gives the standard error
+ * of each tile's total. error() reports that as a fraction of the tile's brightness,
+ * at a chosen percentile over all tiles that have received any light.
+ */
+
+class NoiseEstimate
+{
+public:
+    NoiseEstimate() : mRounds(0) {}
+
+    void begin(const HistogramImage &image);
+    void addRound(const HistogramImage &image);
+    double error(double percentile);
+    unsigned rounds() const { return mRounds; }
+
+private:
+    static const unsigned kTileSize = 32;
+
+    unsigned mRounds;
+    std::vector<double> mPrevious;      // Tile totals at the end of the last round
+    std::vector<double> mSum;           // Sum of per-round amounts
+    std::vector<double> mSumSquares;    // Sum of squared per-round amounts
+    std::vector<double> mCurrent;
+    std::vector<double> mErrors;
+
+    static void tileTotals(const HistogramImage &image, std::vector<double> &totals);
+};
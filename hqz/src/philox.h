@@ -0,0 +1,68 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+
+
+/**
+ * Philox4x32-10, a counter-based random number generator.
+ *
+ * From "Parallel Random Numbers: As Easy as 1, 2, 3" by Salmon, Moraes,
+ * Dror, and Shaw (SC11). Instead of stepping a state, it encrypts a 128-bit
+ * counter with a 64-bit key, so any number in any stream can be computed
+ * directly, in any order, without storing anything.
+ */
+
+struct Philox
+{
+    static void __attribute__((always_inline)) block(uint32_t ctr[4], uint32_t k0, uint32_t k1)
+    {
+        for (unsigned i = 0; i < 10; ++i) {
+            uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+            uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+
+            uint32_t c0 = uint32_t(p1 >> 32) ^ ctr[1] ^ k0;
+            uint32_t c2 = uint32_t(p0 >> 32) ^ ctr[3] ^ k1;
+            ctr[1] = uint32_t(p1);
+            ctr[3] = uint32_t(p0);
+            ctr[0] = c0;
+            ctr[2] = c2;
+
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+    }
+
+    // One uniform number in [0, 1) for counter (c0, c1) under key (k0, k1).
+    static double __attribute__((always_inline)) uniform(uint32_t k0, uint32_t k1, uint32_t c0, uint32_t c1)
+    {
+        uint32_t ctr[4] = { c0, c1, 0, 0 };
+        block(ctr, k0, k1);
+        return ctr[0] * 2.3283064365386963e-10;
+    }
+};
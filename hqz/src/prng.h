@@ -13,6 +13,9 @@ private:
     uint32_t rng0, rng1, rng2, rng3;
 
 public:
+    // Number of generators seedLanes() prepares at once.
+    static const unsigned kLanes = 8;
+
     /**
      * Thoroughly but relatively slowly reinitialize the PRNG state
      * based on a provided 32-bit value. This runs the algorithm for
@@ -40,6 +43,21 @@ public:
             uniform32();
     }
 
+    /**
+     * Seed kLanes generators with consecutive values starting at 'first'.
+     * The lanes share vector registers, so this is several times cheaper per
+     * generator than seed(), and produces exactly the same state.
+     */
+    static void seedLanes(PRNG *out, uint32_t first)
+    {
+        Lanes a, b, c, d;
+        a = (Lanes){} + 0xf1ea5eed;
+        b = c = d = first + laneIndex();
+        for (unsigned i = 0; i < 20; ++i)
+            step(a, b, c, d);
+        store(out, a, b, c, d);
+    }
+
     uint32_t __attribute__((always_inline)) uniform32()
     {
         uint32_t rng4 = (rng0 - ((rng1 << 27) | (rng1 >> 5)));
@@ -59,4 +77,35 @@ public:
     {
         return a + uniform() * (b - a);
     }
+
+private:
+    typedef uint32_t Lanes __attribute__((vector_size(kLanes * sizeof(uint32_t))));
+
+    static Lanes laneIndex()
+    {
+        Lanes v;
+        for (unsigned i = 0; i < kLanes; ++i)
+            v[i] = i;
+        return v;
+    }
+
+    // One round of uniform32(), for every lane.
+    static void __attribute__((always_inline)) step(Lanes &a, Lanes &b, Lanes &c, Lanes &d)
+    {
+        Lanes e = a - ((b << 27) | (b >> 5));
+        a = b ^ ((c << 17) | (c >> 15));
+        b = c + d;
+        c = d + e;
+        d = e + a;
+    }
+
+    static void store(PRNG *out, const Lanes &a, const Lanes &b, const Lanes &c, const Lanes &d)
+    {
+        for (unsigned i = 0; i < kLanes; ++i) {
+            out[i].rng0 = a[i];
+            out[i].rng1 = b[i];
+            out[i].rng2 = c[i];
+            out[i].rng3 = d[i];
+        }
+    }
 };
@@ -28,18 +28,45 @@
 #pragma once
 #include <math.h>
 #include <float.h>
+#include <stdint.h>
 #include <algorithm>
 #include "spectrum.h"
 
 
+/*
+ * Scalar type for stored geometry: points, directions, and bounding boxes.
+ *
+ * Build with "make FLOAT=1" to define HQZ_FLOAT_GEOMETRY, storing geometry and
+ * doing ray/segment and ray/box tests in single precision. Boxes take half the
+ * memory, and the vector slab test fits twice as many lanes in a register.
+ *
+ * Accuracy limits in this mode: a float has a 24-bit mantissa, so at
+ * coordinates around 8192 (an 8K viewport in pixel units) a position is only
+ * good to about 1/2000 of a unit. Intersections are computed relative to the
+ * ray origin, so that error doesn't grow with distance travelled, but surface
+ * points, and the origins of bounced rays, are off by up to that much. Curved
+ * objects need a larger self-intersection distance to match, see below, and
+ * arcs and curves still solve their quadratics in double precision. Scenes
+ * whose coordinates are much larger than their finest detail, or whose detail
+ * is finer than about 1e-3 of the viewport, should stay with double precision.
+ */
+
+#ifdef HQZ_FLOAT_GEOMETRY
+typedef float Real;
+typedef int32_t RealMask;
+#else
+typedef double Real;
+typedef int64_t RealMask;
+#endif
+
 struct Vec2
 {
-    double x, y;
+    Real x, y;
 };
 
 struct AABB
 {
-    double left, top, right, bottom;
+    Real left, top, right, bottom;
 
     bool contains(const AABB &other) const
     {
@@ -56,18 +83,46 @@ struct AABB
     }
 };
 
+/*
+ * Curved surfaces can be hit again by a ray leaving them, so they ignore
+ * hits closer than this. It keeps a reflected ray from finding its own
+ * starting point due to rounding error, which is much larger with
+ * single precision geometry.
+ */
+#ifdef HQZ_FLOAT_GEOMETRY
+static const double kCurveMinDistance = 1e-2;
+#else
+static const double kCurveMinDistance = 1e-7;
+#endif
+
 struct Ray
 {
     Vec2 origin;
     Vec2 direction;
     Color color;
-    double slope;
+    Real slope;
+    Vec2 inverse;       // 1 / direction, for slab tests
+
+    void setDirection(double x, double y)
+    {
+        /*
+         * Always change the direction through here, so the values derived from
+         * it stay in sync. A zero component gets a huge but finite inverse
+         * instead of infinity, so slab tests never multiply zero by infinity.
+         */
+
+        static const Real kTiny = 1e-30f;
+
+        direction.x = x;
+        direction.y = y;
+        slope = y / x;
+        inverse.x = Real(1) / (fabs(x) > kTiny ? Real(x) : Real(copysign(kTiny, x)));
+        inverse.y = Real(1) / (fabs(y) > kTiny ? Real(y) : Real(copysign(kTiny, y)));
+    }
 
     void setAngle(double r)
     {
-        direction.x = cos(r);
-        direction.y = sin(r);
-        slope = direction.y / direction.x;
+        setDirection(cos(r), sin(r));
     }
 
     void reflect(Vec2 normal)
@@ -76,14 +131,12 @@ struct Ray
 
         double t = 2.0 * (normal.x * direction.x + normal.y * direction.y)
             / (normal.x * normal.x + normal.y * normal.y);
-        direction.x -= t * normal.x;
-        direction.y -= t * normal.y;
-        slope = direction.y / direction.x;
+        setDirection(direction.x - t * normal.x, direction.y - t * normal.y);
     }
 
     Vec2 pointAtDistance(double distance) const
     {
-        Vec2 result = { origin.x + distance * direction.x, origin.y + distance * direction.y };
+        Vec2 result = { Real(origin.x + distance * direction.x), Real(origin.y + distance * direction.y) };
         return result;
     }
 
@@ -114,13 +167,13 @@ struct Ray
          *     rayDirection.y + rayOrigin.y - seg1.y) / segD.y
          */
 
-        double n = ((s1.x - origin.x) * slope + (origin.y - s1.y)) / (sD.y - sD.x * slope);
+        Real n = ((s1.x - origin.x) * slope + (origin.y - s1.y)) / (sD.y - sD.x * slope);
         if (n < 0.0) return false;
         if (n > 1.0) return false;
 
         // Now solve for M, the ray/segment distance
 
-        double m = (s1.x + sD.x * n - origin.x) / direction.x;
+        Real m = (s1.x + sD.x * n - origin.x) / direction.x;
         if (m < 0.0) return false;
 
         distance = m;
@@ -134,65 +187,204 @@ struct Ray
         return intersectSegment(s1, sD, distance, alpha);
     }
 
-    bool intersectAABB(const AABB &box, double &closest) const
+    bool intersectArc(Vec2 center, double radius, double start, double sweep, double &distance) const
+    {
+        /*
+         * Ray to circular arc intersection. The arc runs counterclockwise from
+         * angle 'start' by 'sweep' radians, or clockwise if 'sweep' is negative.
+         * On intersection, returns true with the distance to the closest hit.
+         *
+         * The direction is a unit vector, so with o = origin - center,
+         *
+         *   |o + direction * M|^2 = radius^2
+         *   M^2 + 2 (direction . o) M + |o|^2 - radius^2 = 0
+         */
+
+        double ox = origin.x - center.x;
+        double oy = origin.y - center.y;
+        double b = direction.x * ox + direction.y * oy;
+        double c = ox * ox + oy * oy - radius * radius;
+        double discriminant = b * b - c;
+        if (discriminant < 0.0) return false;
+
+        double root = sqrt(discriminant);
+        double candidates[2] = { -b - root, -b + root };
+
+        for (unsigned i = 0; i < 2; ++i) {
+            double m = candidates[i];
+            if (m <= kCurveMinDistance)
+                continue;
+
+            if (fabs(sweep) < 2.0 * M_PI) {
+                // Angle from the start of the arc, in the direction of the sweep
+                double angle = atan2(oy + direction.y * m, ox + direction.x * m) - start;
+                if (sweep < 0.0)
+                    angle = -angle;
+                angle -= 2.0 * M_PI * floor(angle * (0.5 / M_PI));
+                if (angle > fabs(sweep))
+                    continue;
+            }
+
+            distance = m;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool intersectQuadratic(Vec2 p0, Vec2 p1, Vec2 p2, double weight,
+        double &distance, Vec2 &point, double &alpha) const
+    {
+        /*
+         * Ray to rational quadratic Bezier intersection. With weight 1 this is
+         * an ordinary quadratic Bezier curve; other weights trace conic sections.
+         * On intersection, returns true with the distance and point of the closest
+         * hit, and the curve parameter 'alpha' in [0,1].
+         *
+         * The curve is N(t) / D(t), where
+         *
+         *   N(t) = (1-t)^2 p0 + 2 w t(1-t) p1 + t^2 p2
+         *   D(t) = (1-t)^2 + 2 w t(1-t) + t^2
+         *
+         * Points on the ray's line have zero dot product with its normal n after
+         * subtracting the origin. Multiplying through by D(t), that's a quadratic
+         * in t with coefficients built from a_k = n . (p_k - origin):
+         *
+         *   (a0 - 2 w a1 + a2) t^2 + 2 (w a1 - a0) t + a0 = 0
+         */
+
+        double a0 = direction.x * (p0.y - origin.y) - direction.y * (p0.x - origin.x);
+        double a1 = direction.x * (p1.y - origin.y) - direction.y * (p1.x - origin.x);
+        double a2 = direction.x * (p2.y - origin.y) - direction.y * (p2.x - origin.x);
+
+        double qa = a0 - 2.0 * weight * a1 + a2;
+        double qb = 2.0 * (weight * a1 - a0);
+        double qc = a0;
+        double roots[2];
+        unsigned count = 0;
+
+        if (fabs(qa) < 1e-12 * (fabs(qb) + fabs(qc))) {
+            // Effectively linear
+            if (qb == 0.0) return false;
+            roots[count++] = -qc / qb;
+        } else {
+            double discriminant = qb * qb - 4.0 * qa * qc;
+            if (discriminant < 0.0) return false;
+
+            // Numerically stable form, without cancellation
+            double q = -0.5 * (qb + copysign(sqrt(discriminant), qb));
+            roots[count++] = q / qa;
+            if (q != 0.0)
+                roots[count++] = qc / q;
+        }
+
+        bool found = false;
+        for (unsigned i = 0; i < count; ++i) {
+            double t = roots[i];
+            if (!(t >= 0.0 && t <= 1.0))
+                continue;
+
+            double u = 1.0 - t;
+            double b0 = u * u;
+            double b1 = 2.0 * weight * t * u;
+            double b2 = t * t;
+            double denominator = b0 + b1 + b2;
+            if (denominator <= 0.0)
+                continue;
+
+            double px = (b0 * p0.x + b1 * p1.x + b2 * p2.x) / denominator;
+            double py = (b0 * p0.y + b1 * p1.y + b2 * p2.y) / denominator;
+
+            double m = direction.x * (px - origin.x) + direction.y * (py - origin.y);
+            if (m <= kCurveMinDistance || (found && m >= distance))
+                continue;
+
+            distance = m;
+            point.x = px;
+            point.y = py;
+            alpha = t;
+            found = true;
+        }
+
+        return found;
+    }
+
+    bool intersectSlabs(const AABB &box, double &entry, double &exit) const
     {
         /*
-         * Ray to Axis-Aligned Bounding Box intersection.
+         * Ray to Axis-Aligned Bounding Box intersection, by the slab method.
          *
+         * The ray is inside the box between the distances where it's inside both
+         * the box's X and Y extents. Returns true if that range is non-empty
+         * and not entirely behind the origin, with 'entry' and 'exit' set to
+         * its ends. A ray starting inside the box has an entry of zero.
+         */
+
+        Real x0 = (box.left - origin.x) * inverse.x;
+        Real x1 = (box.right - origin.x) * inverse.x;
+        Real y0 = (box.top - origin.y) * inverse.y;
+        Real y1 = (box.bottom - origin.y) * inverse.y;
+
+        Real near = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), Real(0));
+        Real far = std::min(std::max(x0, x1), std::max(y0, y1));
+        entry = near;
+        exit = far;
+        return near <= far;
+    }
+
+    bool intersectAABB(const AABB &box, double &closest) const
+    {
+        /*
          * If the ray begins within 'box' and exits it, returns true with closest==0.
          * If the ray begins outside the box and never touches it, returns false with closest==FLT_MAX.
          * If the ray begins outside the box and intersects it, returns true with 'closest' set to the
          * distance between the origin and the closest part of the box.
          */
 
-        if (box.contains(origin)) {
-            closest = 0;
+        double exit;
+        if (intersectSlabs(box, closest, exit))
             return true;
-        }
 
         closest = FLT_MAX;
+        return false;
+    }
 
+    unsigned intersectAABB(const AABB &first, const AABB &second, double closest[2]) const
+    {
         /*
-         * Quickly rule out rays that can never touch this box
+         * Two intersectAABB() tests at once, one box per vector lane, with no
+         * branches. Returns a bit mask of the boxes we hit: 1 for 'first',
+         * 2 for 'second'. Each 'closest' is set as intersectAABB() would.
          */
 
-        if (origin.x < box.left   && direction.x <= 0) return false;
-        if (origin.x > box.right  && direction.x >= 0) return false;
-        if (origin.y < box.top    && direction.y <= 0) return false;
-        if (origin.y > box.bottom && direction.y >= 0) return false;
+        typedef Real Pair __attribute__((vector_size(2 * sizeof(Real))));
+        typedef RealMask Mask __attribute__((vector_size(2 * sizeof(Real))));
 
-        /*
-         * Now do detailed intersection tests along all four edges. We know
-         * that any ray which hits one edge will hit two, but we don't
-         * yet know which two.
-         */
+        Pair ox = (Pair){} + origin.x;
+        Pair oy = (Pair){} + origin.y;
+        Pair ix = (Pair){} + inverse.x;
+        Pair iy = (Pair){} + inverse.y;
 
-        double dist;
-        bool success = false;
-        Vec2 topLeft = { box.left, box.top };
-        Vec2 topRight = { box.right, box.top };
-        Vec2 bottomLeft = { box.left, box.bottom };
-        Vec2 horizontal = { box.right - box.left, 0 };
-        Vec2 vertical = { 0, box.bottom - box.top };
-
-        if (intersectSegment(topLeft, horizontal, dist)) {
-            success = true;
-            closest = std::min(closest, dist);
-        }
-        if (intersectSegment(topLeft, vertical, dist)) {
-            success = true;
-            closest = std::min(closest, dist);
-        }
-        if (intersectSegment(bottomLeft, horizontal, dist)) {
-            success = true;
-            closest = std::min(closest, dist);
-        }
-        if (intersectSegment(topRight, vertical, dist)) {
-            success = true;
-            closest = std::min(closest, dist);
-        }
+        Pair x0 = ((Pair){ first.left, second.left } - ox) * ix;
+        Pair x1 = ((Pair){ first.right, second.right } - ox) * ix;
+        Pair y0 = ((Pair){ first.top, second.top } - oy) * iy;
+        Pair y1 = ((Pair){ first.bottom, second.bottom } - oy) * iy;
+
+        Pair xNear = x0 < x1 ? x0 : x1;
+        Pair xFar = x0 < x1 ? x1 : x0;
+        Pair yNear = y0 < y1 ? y0 : y1;
+        Pair yFar = y0 < y1 ? y1 : y0;
+
+        Pair entry = xNear > yNear ? xNear : yNear;
+        entry = entry > 0 ? entry : (Pair){};
+        Pair exit = xFar < yFar ? xFar : yFar;
+
+        Mask hit = entry <= exit;
+        Pair result = hit ? entry : (Pair){} + FLT_MAX;
 
-        return success;
+        closest[0] = result[0];
+        closest[1] = result[1];
+        return (hit[0] & 1) | (hit[1] & 2);
     }
 
     double intersectFurthestAABB(const AABB &box) const
@@ -203,29 +395,8 @@ struct Ray
          * we return the distance to the point where it exits the AABB.
          */
 
-        double dist;
-        double furthest = 0;
-
-        Vec2 topLeft = { box.left, box.top };
-        Vec2 horizontal = { box.right - box.left, 0 };
-        Vec2 vertical = { 0, box.bottom - box.top };
-        Vec2 topRight = { box.right, box.top };
-        Vec2 bottomLeft = { box.left, box.bottom };
-
-        if (intersectSegment(topLeft, horizontal, dist)) {
-            furthest = std::max(furthest, dist);
-        }
-        if (intersectSegment(topLeft, vertical, dist)) {
-            furthest = std::max(furthest, dist);
-        }
-        if (intersectSegment(bottomLeft, horizontal, dist)) {
-            furthest = std::max(furthest, dist);
-        }
-        if (intersectSegment(topRight, vertical, dist)) {
-            furthest = std::max(furthest, dist);
-        }
-
-        return furthest;
+        double entry, exit;
+        return intersectSlabs(box, entry, exit) ? exit : 0;
     }
 };
 
@@ -237,6 +408,14 @@ struct IntersectionData
     Vec2 normal;
     double distance;
 
-    // IN: Previous object, to exclude.  OUT: Object we hit.
+    // OUT: Object we hit.
     const rapidjson::Value *object;
+
+    /*
+     * IN: Previous object, to exclude.  OUT: Object we hit.
+     * Objects in instanced groups share a Value, so they're told apart by
+     * number: see ZGroups.
+     */
+    uint32_t id;
+    static const uint32_t kNoObject = 0xFFFFFFFF;
 };
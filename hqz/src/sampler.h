@@ -28,6 +28,8 @@
 #pragma once
 #include "rapidjson/document.h"
 #include "prng.h"
+#include "philox.h"
+#include "sobol.h"
 #include "spectrum.h"
 #include <cfloat>
 #include <algorithm>
@@ -48,6 +50,14 @@ struct Sampler
 {
     PRNG mRandom;
 
+    // Which ray this is (its seed), and how many times it has bounced.
+    uint32_t mRay;
+    uint32_t mBounce;
+
+    // Draws numbered below mSobolEnd come from the Sobol sequence, at index mRay.
+    uint32_t mSobolDimension;
+    uint32_t mSobolEnd;
+
     typedef rapidjson::Value Value;
 
     struct Bounds {
@@ -60,23 +70,48 @@ struct Sampler
         }
     };
 
-    Sampler(uint32_t seed) {
+    Sampler(uint32_t seed)
+        : mRay(seed), mBounce(0), mSobolDimension(0), mSobolEnd(0)
+    {
         mRandom.seed(seed);
     }
 
+    // Start from a generator already seeded with 'seed', e.g. by PRNG::seedLanes().
+    Sampler(const PRNG &random, uint32_t seed)
+        : mRandom(random), mRay(seed), mBounce(0), mSobolDimension(0), mSobolEnd(0) {}
+
     Sampler(const Sampler &parent)
-        : mRandom(parent.mRandom) {}
+        : mRandom(parent.mRandom), mRay(parent.mRay), mBounce(parent.mBounce),
+          mSobolDimension(parent.mSobolDimension), mSobolEnd(parent.mSobolEnd) {}
+
+    /**
+     * Take the next draws from a low-discrepancy sequence instead of the PRNG.
+     * Each ray is one point in the sequence, so a range of rays covers the
+     * sample space more evenly than independent random rays would. After
+     * Sobol::kDimensions draws, or endSobol(), we go back to the PRNG.
+     */
+
+    void beginSobol() {
+        mSobolDimension = 0;
+        mSobolEnd = Sobol::kDimensions;
+    }
+
+    void endSobol() {
+        mSobolEnd = 0;
+    }
 
     uint32_t uniform32() {
+        if (mSobolDimension < mSobolEnd)
+            return Sobol::sample32(mRay, mSobolDimension++);
         return mRandom.uniform32();
     }
 
     double uniform() {
-        return mRandom.uniform();
+        return uniform32() * 2.3283064365386963e-10;
     }
 
     double uniform(double a, double b) {
-        return mRandom.uniform(a, b);
+        return a + uniform() * (b - a);
     }
 
     double blackbody(double temperature) {
@@ -89,6 +124,17 @@ struct Sampler
      */
 
     double value(const Value &v)
+    {
+        return sample(v, *this);
+    }
+
+    /**
+     * The distributions behind value(), for any source of uniform random
+     * numbers. Only draws from 'source' if 'v' is actually random.
+     */
+
+    template <typename Source>
+    static double sample(const Value &v, Source &source)
     {
         if (v.IsNumber()) {
             // Constant
@@ -98,11 +144,14 @@ struct Sampler
         if (v.IsArray() && v.Size() == 2 && v[0u].IsNumber()) {
             // 2-tuples starting with a number
 
-            if (v[1].IsNumber())
-                return uniform(v[0u].GetDouble(), v[1].GetDouble());
+            if (v[1].IsNumber()) {
+                double a = v[0u].GetDouble();
+                double b = v[1].GetDouble();
+                return a + source.uniform() * (b - a);
+            }
 
             if (v[1].IsString() && v[1].GetStringLength() == 1 && v[1].GetString()[0] == 'K')
-                return blackbody(v[0u].GetDouble());
+                return Color::blackbodyWavelength(v[0u].GetDouble(), source.uniform());
         }
 
         // Unknown
@@ -136,3 +185,42 @@ struct Sampler
     }
 
 };
+
+
+/*
+ * Samples the parameters of one object, for one bounce of one ray.
+ *
+ * Every parameter gets its own random number from a counter-based generator,
+ * keyed by (ray, bounce) and indexed by (object, slot in the object's tuple).
+ * Objects can be sampled in any order, any number of times, with no state to
+ * copy, and two objects never see correlated values.
+ */
+
+struct ObjectSampler
+{
+    typedef rapidjson::Value Value;
+
+    uint32_t ray;
+    uint32_t bounce;
+    uint32_t object;
+
+    ObjectSampler(const Sampler &s, uint32_t object)
+        : ray(s.mRay), bounce(s.mBounce), object(object) {}
+
+    // Sample tuple[slot]
+    double value(const Value &tuple, unsigned slot) const
+    {
+        Slot source = { this, slot };
+        return Sampler::sample(tuple[slot], source);
+    }
+
+private:
+    struct Slot {
+        const ObjectSampler *s;
+        uint32_t slot;
+
+        double uniform() const {
+            return Philox::uniform(s->ray, s->bounce, s->object, slot);
+        }
+    };
+};
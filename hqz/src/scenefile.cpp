@@ -0,0 +1,172 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "scenefile.h"
+#include "zbinary.h"
+#include <algorithm>
+#include <sstream>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+SceneFile::SceneFile()
+    : mMapping(0), mMappingSize(0), mAllocator(0), mDocument(0), mBinary(false)
+{}
+
+SceneFile::~SceneFile()
+{
+    // The Document allocates from the pool, and its strings point into our buffers.
+    delete mDocument;
+    delete mAllocator;
+    unmap();
+}
+
+bool SceneFile::load(FILE *f)
+{
+    /*
+     * Prefer a memory mapping when the input is a regular file. Anything else
+     * (pipes, sockets, terminals) is slurped in large blocks instead.
+     */
+
+    if (mapFile(f))
+        return true;
+
+    return readFile(f);
+}
+
+bool SceneFile::mapFile(FILE *f)
+{
+#ifdef _WIN32
+    return false;
+#else
+    int fd = fileno(f);
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return false;
+
+    // We can only map from the beginning. Partially consumed streams get read normally.
+    if (ftell(f) != 0)
+        return false;
+
+    /*
+     * In-situ parsing needs a writable, NUL-terminated buffer. Reserve enough
+     * zero-filled anonymous memory for the file plus a terminator, then map the
+     * file privately over the front of it. Writes from the parser are copy-on-write
+     * and never reach the file. Whether or not the file ends on a page boundary,
+     * the byte after it is guaranteed to be zero.
+     */
+
+    size_t length = st.st_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (length + page) & ~(page - 1);
+
+    void *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    if (mmap(base, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, size);
+        return false;
+    }
+
+    mMapping = (char*) base;
+    mMappingSize = size;
+    madvise(mMapping, length, MADV_SEQUENTIAL);
+
+    parse(mMapping, length);
+    return true;
+#endif
+}
+
+bool SceneFile::readFile(FILE *f)
+{
+    size_t length = 0;
+
+    for (;;) {
+        mBuffer.resize(length + kReadBlockSize + 1);
+        size_t count = fread(&mBuffer[length], 1, kReadBlockSize, f);
+        length += count;
+        if (count < kReadBlockSize)
+            break;
+    }
+
+    if (ferror(f))
+        return false;
+
+    mBuffer[length] = '\0';
+    parse(&mBuffer[0], length);
+    return true;
+}
+
+void SceneFile::parse(char *text, size_t length)
+{
+    /*
+     * The DOM is typically a small multiple of the text size. Sizing the pool
+     * chunks to the input keeps the allocation count low for huge scenes
+     * without wasting memory on tiny ones.
+     */
+
+    static const size_t kMinChunkSize = 64 * 1024;
+
+    delete mDocument;
+    delete mAllocator;
+
+    mAllocator = new Allocator(std::max(kMinChunkSize, length));
+    mDocument = new Document(mAllocator);
+    mError.clear();
+
+    std::ostringstream err;
+    mBinary = ZBinary::isBinary(text, length);
+
+    if (mBinary) {
+        ZBinary::decode(text, length, *mDocument, err);
+    } else {
+        mDocument->ParseInsitu<0>(text);
+        if (mDocument->HasParseError()) {
+            err << "Parse error at character " << mDocument->GetErrorOffset()
+                << ": " << mDocument->GetParseError() << "\n";
+        }
+    }
+
+    mError = err.str();
+}
+
+void SceneFile::unmap()
+{
+#ifndef _WIN32
+    if (mMapping)
+        munmap(mMapping, mMappingSize);
+#endif
+    mMapping = 0;
+    mMappingSize = 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include "rapidjson/document.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Owns the bytes and the DOM for one scene description.
+ *
+ * Regular files are memory-mapped copy-on-write and parsed in-situ, so strings
+ * in the Document point directly into the mapping. Pipes and other streams that
+ * can't be mapped are read in large blocks into a heap buffer, then parsed the
+ * same way. Values are allocated from a memory pool sized to the input, so large
+ * scenes don't pay for thousands of small chunk allocations.
+ *
+ * Input in the binary scene format (see zbinary.h) is detected automatically,
+ * and decoded straight from the mapping into the same kind of Document.
+ *
+ * The Document refers to our buffer, so a SceneFile must outlive any
+ * ZRender that was constructed from it.
+ */
+
+class SceneFile {
+public:
+    typedef rapidjson::Document Document;
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+    SceneFile();
+    ~SceneFile();
+
+    // Returns false and sets errno on I/O failure. Parse errors are reported by hasError().
+    bool load(FILE *f);
+
+    // Parse a caller-owned buffer in place. It must have a NUL at text[length],
+    // and must outlive this SceneFile.
+    void parse(char *text, size_t length);
+
+    Document &document() { return *mDocument; }
+    bool isBinary() const { return mBinary; }
+
+    const char *errorText() const { return mError.c_str(); }
+    bool hasError() const { return !mError.empty(); }
+
+private:
+    static const size_t kReadBlockSize = 1 << 20;
+
+    char *mMapping;
+    size_t mMappingSize;
+    std::vector<char> mBuffer;
+
+    Allocator *mAllocator;
+    Document *mDocument;
+    bool mBinary;
+    std::string mError;
+
+    bool mapFile(FILE *f);
+    bool readFile(FILE *f);
+    void unmap();
+
+    // Not copyable; the Document points into our buffers.
+    SceneFile(const SceneFile &);
+    SceneFile &operator=(const SceneFile &);
+};
@@ -0,0 +1,86 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "sobol.h"
+
+namespace {
+
+    // Primitive polynomials and initial direction numbers, from new-joe-kuo-6.21201.
+    // The first dimension is the van der Corput sequence, and has no entry here.
+
+    struct Polynomial {
+        unsigned degree;
+        uint32_t coefficients;
+        uint32_t m[6];
+    };
+
+    const Polynomial kPolynomials[Sobol::kDimensions - 1] = {
+        { 1,  0, { 1 } },
+        { 2,  1, { 1, 3 } },
+        { 3,  1, { 1, 3, 1 } },
+        { 3,  2, { 1, 1, 1 } },
+        { 4,  1, { 1, 1, 3, 3 } },
+        { 4,  4, { 1, 3, 5, 13 } },
+        { 5,  2, { 1, 1, 5, 5, 17 } },
+        { 5,  4, { 1, 1, 5, 5, 5 } },
+        { 5,  7, { 1, 1, 7, 11, 19 } },
+        { 5, 11, { 1, 1, 5, 1, 1 } },
+        { 5, 13, { 1, 1, 1, 3, 11 } },
+        { 5, 14, { 1, 3, 5, 5, 31 } },
+        { 6,  1, { 1, 3, 3, 9, 7, 49 } },
+        { 6, 13, { 1, 1, 1, 15, 21, 21 } },
+        { 6, 16, { 1, 3, 1, 13, 27, 49 } },
+    };
+}
+
+bool Sobol::initMatrix()
+{
+    // Bit-reversed identity
+    for (unsigned i = 0; i < 32; ++i)
+        sMatrix[0][i] = 1u << (31 - i);
+
+    for (unsigned d = 1; d < kDimensions; ++d) {
+        const Polynomial &p = kPolynomials[d - 1];
+        uint32_t *v = sMatrix[d];
+
+        for (unsigned i = 0; i < p.degree; ++i)
+            v[i] = p.m[i] << (31 - i);
+
+        for (unsigned i = p.degree; i < 32; ++i) {
+            v[i] = v[i - p.degree] ^ (v[i - p.degree] >> p.degree);
+            for (unsigned k = 1; k < p.degree; ++k)
+                if ((p.coefficients >> (p.degree - 1 - k)) & 1)
+                    v[i] ^= v[i - k];
+        }
+    }
+
+    return true;
+}
+
+uint32_t Sobol::sMatrix[kDimensions][32];
+bool Sobol::sMatrixReady = Sobol::initMatrix();
@@ -0,0 +1,88 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include <stdint.h>
+
+
+/**
+ * Owen-scrambled Sobol sequence, for quasi-Monte Carlo sampling.
+ *
+ * Points are looked up directly by index, so any range of indices can be
+ * rendered independently. Direction numbers are from Joe and Kuo's
+ * new-joe-kuo-6.21201 table, and scrambling uses Burley's hash-based nested
+ * uniform scramble ("Practical Hash-based Owen Scrambling", JCGT 2020).
+ */
+
+class Sobol {
+public:
+    static const unsigned kDimensions = 16;
+
+    static uint32_t __attribute__((always_inline)) sample32(uint32_t index, unsigned dimension)
+    {
+        const uint32_t *v = sMatrix[dimension];
+        uint32_t x = 0;
+        for (; index; index >>= 1, ++v)
+            if (index & 1)
+                x ^= *v;
+        return scramble(x, dimension);
+    }
+
+    // Uniform in [0, 1), like PRNG::uniform().
+    static double __attribute__((always_inline)) uniform(uint32_t index, unsigned dimension)
+    {
+        return sample32(index, dimension) * 2.3283064365386963e-10;
+    }
+
+private:
+    static uint32_t sMatrix[kDimensions][32];
+    static bool sMatrixReady;
+    static bool initMatrix();
+
+    static uint32_t __attribute__((always_inline)) reverse(uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        return __builtin_bswap32(x);
+    }
+
+    static uint32_t __attribute__((always_inline)) scramble(uint32_t x, unsigned dimension)
+    {
+        // Each dimension gets its own fixed scramble.
+        uint32_t seed = (dimension + 1) * 0x9e3779b9u;
+
+        x = reverse(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverse(x);
+    }
+};
@@ -1540,6 +1540,119 @@ double Color::blackbodyWavelength(double temperature, double uniform)
     return nm;
 }
 
+double Color::blackbodyCumulative(double temperature, double nm)
+{
+    /*
+     * The inverse of blackbodyWavelength(): the probability that a blackbody
+     * at 'temperature' emits at a wavelength no longer than 'nm'. Uses the same
+     * linear interpolation between table entries, so the two agree exactly.
+     * Entry i of the table covers wavelength indices [i+1, i+2).
+     */
+
+    const unsigned size = sizeof blackbodyCDF / sizeof blackbodyCDF[0];
+    double index = nm * temperature / kBlackbodyCDFTemperature;
+
+    if (!(index >= 1))
+        return 0;
+    if (index >= size)
+        return blackbodyCDF[size - 1];
+
+    unsigned i = index;
+    double lower = blackbodyCDF[i - 1];
+    double upper = blackbodyCDF[i];
+    return lower + (index - i) * (upper - lower);
+}
+
+void Color::visibleBand(double &first, double &last)
+{
+    /*
+     * The range of wavelengths for which setWavelength() produces a nonzero
+     * color. Because of integer truncation this is a little narrower than the
+     * table itself, so find the edges by bisection. Computed once.
+     */
+
+    struct Band {
+        double first, last;
+
+        static bool visible(double nm) {
+            Color c;
+            c.setWavelength(nm);
+            return c.isVisible();
+        }
+
+        static double edge(double inside, double outside) {
+            for (unsigned i = 0; i < 64; ++i) {
+                double mid = 0.5 * (inside + outside);
+                if (visible(mid))
+                    inside = mid;
+                else
+                    outside = mid;
+            }
+            return inside;
+        }
+
+        Band() {
+            double mid = 0.5 * (kFirstWavelength + kLastWavelength);
+            first = visible(kFirstWavelength) ? kFirstWavelength : edge(mid, kFirstWavelength);
+
+            // The table has no entry past kLastWavelength to interpolate toward, so don't probe it.
+            last = edge(mid, kLastWavelength);
+        }
+    };
+
+    static const Band band;
+    first = band.first;
+    last = band.last;
+}
+
+bool VisibleSpectrum::initUniform(double a, double b)
+{
+    /*
+     * Uniform distributions stay uniform when clipped; their inverse CDF is a line.
+     * Keep the endpoints in their original order, so that a range which is already
+     * visible maps each uniform input to the same wavelength Sampler::value() would.
+     */
+
+    double first, last;
+    Color::visibleBand(first, last);
+
+    double lower = std::max(std::min(a, b), first);
+    double upper = std::min(std::max(a, b), last);
+    if (!(lower <= upper))
+        return false;
+
+    mTable.resize(2);
+    mTable[0] = a <= b ? lower : upper;
+    mTable[1] = a <= b ? upper : lower;
+    return true;
+}
+
+bool VisibleSpectrum::initBlackbody(double temperature)
+{
+    /*
+     * Find the range of blackbodyWavelength()'s uniform input that lands in the
+     * visible band, and tabulate its output evenly across that range.
+     */
+
+    double first, last;
+    Color::visibleBand(first, last);
+
+    if (!(temperature > 0))
+        return false;
+
+    double lower = Color::blackbodyCumulative(temperature, first);
+    double upper = Color::blackbodyCumulative(temperature, last);
+    if (!(upper > lower))
+        return false;
+
+    mTable.resize(kTableSize + 1);
+    for (unsigned i = 0; i <= kTableSize; ++i) {
+        double nm = Color::blackbodyWavelength(temperature, lower + (upper - lower) * i / kTableSize);
+        mTable[i] = std::max(first, std::min(last, nm));
+    }
+    return true;
+}
+
 void Color::testSpectrum(double temperature)
 {
     // Test code for our blackbodyWavelength() transform.
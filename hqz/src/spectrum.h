@@ -28,6 +28,7 @@
 #pragma once
 #include <stdint.h>
 #include <math.h>
+#include <vector>
 
 
 struct Color
@@ -37,6 +38,8 @@ struct Color
     void setWavelength(double nm);
 
     static double blackbodyWavelength(double temperature, double uniform);
+    static double blackbodyCumulative(double temperature, double nm);
+    static void visibleBand(double &first, double &last);
     static void testSpectrum(double temperature);
 
     void __attribute__((always_inline)) plot(int64_t *ptr, int intensity)
@@ -51,3 +54,35 @@ struct Color
         return r || g || b;
     }
 };
+
+
+/**
+ * Samples a wavelength distribution restricted to the visible band.
+ *
+ * This is a tabulated inverse CDF of the part of the distribution that
+ * setWavelength() can see, so every sample is visible, and each one takes a
+ * single uniform random number and a constant-time lookup. Conditioning on
+ * visibility this way gives the same distribution as drawing from the full
+ * spectrum and rejecting invisible wavelengths.
+ */
+
+class VisibleSpectrum
+{
+public:
+    // Returns false if none of the distribution is visible.
+    bool initUniform(double a, double b);
+    bool initBlackbody(double temperature);
+
+    double __attribute__((always_inline)) sample(double uniform) const
+    {
+        unsigned n = mTable.size() - 1;
+        double x = uniform * n;
+        unsigned i = x;
+        if (i >= n) i = n - 1;
+        return mTable[i] + (x - i) * (mTable[i + 1] - mTable[i]);
+    }
+
+private:
+    static const unsigned kTableSize = 4096;
+    std::vector<double> mTable;
+};
@@ -0,0 +1,262 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "zbench.h"
+#include "scenefile.h"
+#include "zrender.h"
+#include "timer.h"
+#include "lodepng.h"
+#include <sys/resource.h>
+#include <string.h>
+#include <algorithm>
+
+static const char *kScenes[] = { "bounces", "objects", "random", "lights", "highres" };
+
+
+ZBench::ZBench(const char *sceneDir)
+    : mSceneDir(sceneDir)
+{}
+
+int ZBench::run(FILE *out, const char *baselinePath, double threshold)
+{
+    /*
+     * Every scene must render. A benchmark that quietly skipped one would
+     * be useless for comparisons, so stop at the first failure. Exit status
+     * matches what hqz would return when rendering that scene.
+     *
+     * Results are always written, even if they don't match the baseline, so
+     * they can be inspected or adopted as the new baseline.
+     */
+
+    for (unsigned i = 0; i < sizeof kScenes / sizeof kScenes[0]; ++i) {
+        fprintf(stderr, "Benchmark: %s\n", kScenes[i]);
+        int status = runScene(kScenes[i]);
+        if (status)
+            return status;
+    }
+
+    write(out);
+    return baselinePath ? compare(baselinePath, threshold) : 0;
+}
+
+int ZBench::runScene(const char *name)
+{
+    std::string path = mSceneDir + "/" + name + ".json";
+    Timer totalTimer;
+
+    FILE *sceneF = fopen(path.c_str(), "r");
+    if (!sceneF) {
+        perror(path.c_str());
+        return 2;
+    }
+
+    SceneFile sceneFile;
+    bool loaded = sceneFile.load(sceneF);
+    fclose(sceneF);
+    if (!loaded) {
+        perror(path.c_str());
+        return 2;
+    }
+    if (sceneFile.hasError()) {
+        fprintf(stderr, "%s: %s", path.c_str(), sceneFile.errorText());
+        return 4;
+    }
+    double parseTime = totalTimer.elapsed();
+
+    // Time limits make the number of rays, and so the image, vary between runs.
+    const rapidjson::Value &timeLimit = sceneFile.document()["timelimit"];
+    bool deterministic = !(timeLimit.IsNumber() && timeLimit.GetDouble() > 0);
+
+    ZRender zr(sceneFile.document());
+    if (zr.hasError()) {
+        fprintf(stderr, "%s: Scene errors:\n%s", path.c_str(), zr.errorText());
+        return 5;
+    }
+
+    std::vector<unsigned char> pixels;
+    zr.render(pixels);
+    if (zr.hasError()) {
+        fprintf(stderr, "%s: Renderer errors:\n%s", path.c_str(), zr.errorText());
+        return 7;
+    }
+
+    // Encode to memory; the file system isn't part of the benchmark.
+    Timer encodeTimer;
+    std::vector<unsigned char> png;
+    lodepng::encode(png, pixels, zr.width(), zr.height(), LCT_RGB);
+
+    const ZRender::Stats &stats = zr.stats();
+    Result r;
+    r.name = name;
+    r.rays = stats.rays;
+    r.segments = stats.segments;
+    r.parseTime = parseTime;
+    r.buildTime = stats.buildTime;
+    r.traceTime = stats.traceTime;
+    r.toneMapTime = stats.toneMapTime;
+    r.encodeTime = encodeTimer.elapsed();
+    r.totalTime = totalTimer.elapsed();
+    r.hash = zr.histogram().hash();
+    r.deterministic = deterministic;
+    mResults.push_back(r);
+
+    return 0;
+}
+
+void ZBench::write(FILE *out)
+{
+    uint64_t rays = 0;
+    uint64_t segments = 0;
+    double traceTime = 0;
+    double totalTime = 0;
+
+    fprintf(out, "{\n  \"scenes\": [\n");
+
+    for (unsigned i = 0; i < mResults.size(); ++i) {
+        const Result &r = mResults[i];
+        double t = std::max(r.traceTime, 1e-9);
+
+        fprintf(out,
+            "    {\"name\": \"%s\", \"rays\": %llu, \"segments\": %llu, "
+            "\"raysPerSecond\": %.0f, \"segmentsPerSecond\": %.0f,\n"
+            "     \"hash\": \"%016llx\", \"deterministic\": %s,\n"
+            "     \"seconds\": {\"parse\": %.6f, \"build\": %.6f, \"trace\": %.6f, "
+            "\"toneMap\": %.6f, \"encode\": %.6f, \"total\": %.6f}}%s\n",
+            r.name, (unsigned long long) r.rays, (unsigned long long) r.segments,
+            r.rays / t, r.segments / t,
+            (unsigned long long) r.hash, r.deterministic ? "true" : "false",
+            r.parseTime, r.buildTime, r.traceTime, r.toneMapTime, r.encodeTime, r.totalTime,
+            i + 1 == mResults.size() ? "" : ",");
+
+        rays += r.rays;
+        segments += r.segments;
+        traceTime += r.traceTime;
+        totalTime += r.totalTime;
+    }
+
+    traceTime = std::max(traceTime, 1e-9);
+    fprintf(out,
+        "  ],\n"
+        "  \"total\": {\"rays\": %llu, \"segments\": %llu, "
+        "\"raysPerSecond\": %.0f, \"segmentsPerSecond\": %.0f, \"seconds\": %.6f},\n"
+        "  \"peakRSS\": %llu\n"
+        "}\n",
+        (unsigned long long) rays, (unsigned long long) segments,
+        rays / traceTime, segments / traceTime, totalTime,
+        (unsigned long long) peakRSS());
+}
+
+int ZBench::compare(const char *baselinePath, double threshold)
+{
+    /*
+     * Compare against a baseline, reporting each scene on stderr. A changed
+     * image is worse than a slow one, so kHashChanged takes precedence.
+     */
+
+    FILE *f = fopen(baselinePath, "r");
+    if (!f) {
+        perror(baselinePath);
+        return 2;
+    }
+
+    SceneFile baseline;
+    bool loaded = baseline.load(f);
+    fclose(f);
+    if (!loaded) {
+        perror(baselinePath);
+        return 2;
+    }
+    if (baseline.hasError()) {
+        fprintf(stderr, "%s: %s", baselinePath, baseline.errorText());
+        return 4;
+    }
+
+    const rapidjson::Value &scenes = baseline.document()["scenes"];
+    if (!scenes.IsArray()) {
+        fprintf(stderr, "%s: Not a benchmark result\n", baselinePath);
+        return 4;
+    }
+
+    bool hashChanged = false;
+    bool slower = false;
+
+    for (unsigned i = 0; i < mResults.size(); ++i) {
+        const Result &r = mResults[i];
+        const rapidjson::Value *old = 0;
+
+        for (unsigned j = 0; j < scenes.Size(); ++j) {
+            const rapidjson::Value &name = scenes[j]["name"];
+            if (name.IsString() && !strcmp(name.GetString(), r.name))
+                old = &scenes[j];
+        }
+
+        if (!old || !(*old)["hash"].IsString() || !(*old)["raysPerSecond"].IsNumber()) {
+            fprintf(stderr, "%-10s not in baseline\n", r.name);
+            continue;
+        }
+
+        char hash[17];
+        snprintf(hash, sizeof hash, "%016llx", (unsigned long long) r.hash);
+        const char *oldHash = (*old)["hash"].GetString();
+        bool hashOk = !r.deterministic || !strcmp(hash, oldHash);
+
+        double rate = r.rays / std::max(r.traceTime, 1e-9);
+        double oldRate = (*old)["raysPerSecond"].GetDouble();
+        double change = oldRate > 0 ? rate / oldRate - 1.0 : 0.0;
+        bool rateOk = change >= -threshold;
+
+        fprintf(stderr, "%-10s %s  %.0f rays/s, baseline %.0f (%+.1f%%)%s\n",
+            r.name,
+            !r.deterministic ? "hash not compared" : hashOk ? "hash ok" : "HASH CHANGED",
+            rate, oldRate, change * 100.0,
+            rateOk ? "" : "  SLOWER");
+
+        if (!hashOk)
+            fprintf(stderr, "%-10s was %s, now %s\n", "", oldHash, hash);
+
+        hashChanged |= !hashOk;
+        slower |= !rateOk;
+    }
+
+    return hashChanged ? kHashChanged : slower ? kSlower : 0;
+}
+
+uint64_t ZBench::peakRSS()
+{
+    // Peak resident set size of this process, in bytes
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Standard benchmark suite.
+ *
+ * Renders a fixed set of scenes from a directory, each one stressing a different
+ * part of the renderer, and writes the results to stdout as JSON:
+ *
+ *   bounces    A few objects in a closed mirror room; long paths
+ *   objects    Thousands of small objects; quadtree traversal
+ *   random     Objects with random-variable coordinates; per-object sampling
+ *   lights     Many lights with different spectra; light selection
+ *   highres    A 4K frame with long segments; rasterization and tone mapping
+ *
+ * For each scene we report rays and segments per second, the time spent in
+ * each phase, and a hash of the raw histogram. Scenes run one after another in
+ * a single process, and the peak resident set size is for the whole run.
+ *
+ * With a baseline (earlier output of the same suite), results are also checked
+ * against it: a changed hash on a deterministic scene means the renderer now
+ * draws a different image, and a drop in rays per second beyond the threshold
+ * is a performance regression. Hashes depend on the compiler, flags and CPU, so
+ * baselines are only comparable on the machine and build setup that made them.
+ */
+
+class ZBench {
+public:
+    // Exit statuses for run(), beyond those hqz uses for render errors
+    static const int kHashChanged = 8;
+    static const int kSlower = 9;
+
+    ZBench(const char *sceneDir);
+    int run(FILE *out, const char *baselinePath = 0, double threshold = 0.1);
+
+private:
+    struct Result {
+        const char *name;
+        uint64_t rays;
+        uint64_t segments;
+        double parseTime;
+        double buildTime;
+        double traceTime;
+        double toneMapTime;
+        double encodeTime;
+        double totalTime;
+        uint64_t hash;
+        bool deterministic;
+    };
+
+    std::string mSceneDir;
+    std::vector<Result> mResults;
+
+    int runScene(const char *name);
+    int compare(const char *baselinePath, double threshold);
+    void write(FILE *out);
+    static uint64_t peakRSS();
+};
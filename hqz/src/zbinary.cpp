@@ -0,0 +1,769 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "zbinary.h"
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+
+namespace {
+
+typedef rapidjson::Value Value;
+typedef rapidjson::Document Document;
+typedef rapidjson::Document::AllocatorType Allocator;
+
+struct Section {
+    uint64_t offset;    // Bytes from the beginning of the file
+    uint64_t count;     // Number of elements, or bytes for text sections
+};
+
+struct Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved;
+
+    Section settings;
+    Section lights;
+    Section objects;
+    Section materials;
+    Section outcomes;
+    Section values;
+    Section pairs;
+    Section strings;
+};
+
+static const char kMagic[4] = { 'H', 'Q', 'Z', 'B' };
+
+// Header flags: which tables were stored in binary rather than left in 'settings'.
+static const uint32_t kHasLights = 1 << 0;
+static const uint32_t kHasObjects = 1 << 1;
+static const uint32_t kHasMaterials = 1 << 2;
+
+// Descriptor boxing
+static const uint64_t kBoxMask = 0xFFF8000000000000ULL;
+static const unsigned kTagShift = 48;
+static const uint64_t kTagMask = 7;
+static const uint64_t kPayloadMask = (1ULL << kTagShift) - 1;
+
+enum Tag {
+    kTagNull,
+    kTagFalse,
+    kTagTrue,
+    kTagInt,            // Payload is a 32-bit signed integer
+    kTagString,         // Payload is an offset into 'strings'
+    kTagUniform,        // Payload is a pair reference: [ min, max ]
+    kTagBlackbody,      // Payload is a pair reference: [ temperature, "K" ]
+    kTagJSON,           // Payload is an offset into 'strings' for a JSON fragment
+};
+
+// Pair references: an index into 'pairs', plus flags for members that were integers.
+static const uint64_t kPairFirstInt = 1ULL << 47;
+static const uint64_t kPairSecondInt = 1ULL << 46;
+static const uint64_t kPairIndexMask = kPairSecondInt - 1;
+
+
+/*
+ * JSON text output. Numbers are written in the shortest form that parses back
+ * to the same double, and doubles always keep a decimal point so they don't
+ * come back as integers.
+ */
+
+class TextWriter {
+public:
+    TextWriter(std::vector<char> &buffer, FILE *f = 0)
+        : mBuffer(buffer), mFile(f) {}
+
+    ~TextWriter() {
+        flush();
+    }
+
+    void value(const Value &v);
+    void member(const Value::Member &m, bool first);
+    void put(char c) { mBuffer.push_back(c); }
+
+private:
+    static const size_t kFlushSize = 64 * 1024;
+
+    std::vector<char> &mBuffer;
+    FILE *mFile;
+
+    void write(const char *s) { mBuffer.insert(mBuffer.end(), s, s + strlen(s)); }
+    void string(const char *s, size_t length);
+    void number(const Value &v);
+    void flush();
+};
+
+void TextWriter::flush()
+{
+    if (mFile && !mBuffer.empty()) {
+        fwrite(&mBuffer[0], 1, mBuffer.size(), mFile);
+        mBuffer.clear();
+    }
+}
+
+void TextWriter::value(const Value &v)
+{
+    switch (v.GetType()) {
+
+        case rapidjson::kNullType:      write("null"); break;
+        case rapidjson::kFalseType:     write("false"); break;
+        case rapidjson::kTrueType:      write("true"); break;
+        case rapidjson::kNumberType:    number(v); break;
+
+        case rapidjson::kStringType:
+            string(v.GetString(), v.GetStringLength());
+            break;
+
+        case rapidjson::kArrayType:
+            put('[');
+            for (unsigned i = 0, e = v.Size(); i != e; ++i) {
+                if (i) put(',');
+                value(v[i]);
+            }
+            put(']');
+            break;
+
+        case rapidjson::kObjectType: {
+            put('{');
+            bool first = true;
+            for (Value::ConstMemberIterator i = v.MemberBegin(), e = v.MemberEnd(); i != e; ++i) {
+                member(*i, first);
+                first = false;
+            }
+            put('}');
+            break;
+        }
+    }
+
+    if (mBuffer.size() >= kFlushSize)
+        flush();
+}
+
+void TextWriter::member(const Value::Member &m, bool first)
+{
+    if (!first) put(',');
+    string(m.name.GetString(), m.name.GetStringLength());
+    put(':');
+    value(m.value);
+}
+
+void TextWriter::number(const Value &v)
+{
+    char buf[40];
+
+    if (v.IsInt64()) {
+        snprintf(buf, sizeof buf, "%" PRId64, v.GetInt64());
+    } else if (v.IsUint64()) {
+        snprintf(buf, sizeof buf, "%" PRIu64, v.GetUint64());
+    } else {
+        double d = v.GetDouble();
+        snprintf(buf, sizeof buf, "%.15g", d);
+        if (strtod(buf, 0) != d)
+            snprintf(buf, sizeof buf, "%.17g", d);
+        if (!strpbrk(buf, ".eEn"))
+            strcat(buf, ".0");
+    }
+
+    write(buf);
+}
+
+void TextWriter::string(const char *s, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    put('"');
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = s[i];
+        switch (c) {
+            case '"':   write("\\\""); break;
+            case '\\':  write("\\\\"); break;
+            case '\n':  write("\\n"); break;
+            case '\r':  write("\\r"); break;
+            case '\t':  write("\\t"); break;
+            default:
+                if (c < 0x20) {
+                    write("\\u00");
+                    put(hex[c >> 4]);
+                    put(hex[c & 15]);
+                } else {
+                    put(c);
+                }
+        }
+    }
+    put('"');
+}
+
+
+/*
+ * Encoder: JSON DOM to binary.
+ */
+
+class Encoder {
+public:
+    Encoder(std::ostream &err) : mError(err) {}
+    bool run(const Value &scene, std::vector<char> &out);
+
+private:
+    typedef std::vector<uint32_t> Index;
+
+    std::ostream &mError;
+
+    std::vector<char> mSettings;
+    Index mLights;
+    Index mObjects;
+    Index mMaterials;
+    Index mOutcomes;
+    std::vector<uint64_t> mValues;
+    std::vector<double> mPairs;
+    std::vector<char> mStrings;
+
+    static bool isTupleTable(const Value &v);
+    static bool isMaterialTable(const Value &v);
+    static bool isPairNumber(const Value &v) { return v.IsInt() || v.IsDouble(); }
+
+    void tuple(const Value &t, Index &index);
+    uint64_t descriptor(const Value &v);
+    uint64_t box(Tag tag, uint64_t payload) { return kBoxMask | (uint64_t(tag) << kTagShift) | payload; }
+    uint64_t pair(const Value &a, const Value &b);
+    uint64_t string(const char *s, size_t length);
+
+    template <typename T> static void section(std::vector<char> &out, Section &s,
+        const std::vector<T> &v, uint64_t count);
+};
+
+bool Encoder::isTupleTable(const Value &v)
+{
+    if (!v.IsArray())
+        return false;
+    for (unsigned i = 0, e = v.Size(); i != e; ++i)
+        if (!v[i].IsArray())
+            return false;
+    return true;
+}
+
+bool Encoder::isMaterialTable(const Value &v)
+{
+    if (!v.IsArray())
+        return false;
+    for (unsigned i = 0, e = v.Size(); i != e; ++i)
+        if (!isTupleTable(v[i]))
+            return false;
+    return true;
+}
+
+uint64_t Encoder::pair(const Value &a, const Value &b)
+{
+    uint64_t ref = mPairs.size() / 2;
+
+    mPairs.push_back(a.GetDouble());
+    if (a.IsInt())
+        ref |= kPairFirstInt;
+
+    if (b.IsNumber()) {
+        mPairs.push_back(b.GetDouble());
+        if (b.IsInt())
+            ref |= kPairSecondInt;
+    } else {
+        mPairs.push_back(0);
+    }
+
+    return ref;
+}
+
+uint64_t Encoder::string(const char *s, size_t length)
+{
+    uint64_t offset = mStrings.size();
+    mStrings.insert(mStrings.end(), s, s + length);
+    mStrings.push_back('\0');
+    return offset;
+}
+
+uint64_t Encoder::descriptor(const Value &v)
+{
+    if (v.IsInt())
+        return box(kTagInt, uint32_t(v.GetInt()));
+
+    if (v.IsDouble()) {
+        double d = v.GetDouble();
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof bits);
+        return bits;
+    }
+
+    if (v.IsNull())
+        return box(kTagNull, 0);
+    if (v.IsFalse())
+        return box(kTagFalse, 0);
+    if (v.IsTrue())
+        return box(kTagTrue, 0);
+
+    if (v.IsString())
+        return box(kTagString, string(v.GetString(), v.GetStringLength()));
+
+    // The random variables understood by Sampler::value(), stored as typed pairs.
+    if (v.IsArray() && v.Size() == 2 && isPairNumber(v[0u])) {
+        if (isPairNumber(v[1]))
+            return box(kTagUniform, pair(v[0u], v[1]));
+
+        if (v[1].IsString() && v[1].GetStringLength() == 1 && v[1].GetString()[0] == 'K')
+            return box(kTagBlackbody, pair(v[0u], v[1]));
+    }
+
+    // Everything else is kept as JSON text.
+
+    std::vector<char> text;
+    {
+        TextWriter w(text);
+        w.value(v);
+    }
+    return box(kTagJSON, string(&text[0], text.size()));
+}
+
+void Encoder::tuple(const Value &t, Index &index)
+{
+    index.push_back(mValues.size());
+    for (unsigned i = 0, e = t.Size(); i != e; ++i)
+        mValues.push_back(descriptor(t[i]));
+}
+
+template <typename T>
+void Encoder::section(std::vector<char> &out, Section &s, const std::vector<T> &v, uint64_t count)
+{
+    // Append a section, padding it out to 8-byte alignment.
+
+    s.offset = out.size();
+    s.count = count;
+    if (!v.empty()) {
+        const char *bytes = (const char*) &v[0];
+        out.insert(out.end(), bytes, bytes + v.size() * sizeof v[0]);
+    }
+    out.resize((out.size() + 7) & ~size_t(7));
+}
+
+bool Encoder::run(const Value &scene, std::vector<char> &out)
+{
+    if (!scene.IsObject()) {
+        mError << "Scene must be a JSON object\n";
+        return false;
+    }
+
+    /*
+     * Tables go to binary only if they have the expected shape. Anything
+     * malformed stays in the settings JSON, so the renderer reports the
+     * same errors it would have reported for the original file.
+     */
+
+    uint32_t flags = 0;
+    const Value &lights = scene["lights"];
+    const Value &objects = scene["objects"];
+    const Value &materials = scene["materials"];
+
+    if (isTupleTable(lights)) {
+        flags |= kHasLights;
+        for (unsigned i = 0, e = lights.Size(); i != e; ++i)
+            tuple(lights[i], mLights);
+        mLights.push_back(mValues.size());
+    }
+
+    if (isTupleTable(objects)) {
+        flags |= kHasObjects;
+        for (unsigned i = 0, e = objects.Size(); i != e; ++i)
+            tuple(objects[i], mObjects);
+        mObjects.push_back(mValues.size());
+    }
+
+    if (isMaterialTable(materials)) {
+        flags |= kHasMaterials;
+        for (unsigned i = 0, e = materials.Size(); i != e; ++i) {
+            const Value &material = materials[i];
+            mMaterials.push_back(mOutcomes.size());
+            for (unsigned j = 0, f = material.Size(); j != f; ++j)
+                tuple(material[j], mOutcomes);
+        }
+        mMaterials.push_back(mOutcomes.size());
+        mOutcomes.push_back(mValues.size());
+    }
+
+    if (mValues.size() > 0xFFFFFFFFu) {
+        mError << "Scene is too large for the binary format\n";
+        return false;
+    }
+
+    // Everything else
+    {
+        TextWriter w(mSettings);
+        bool first = true;
+        w.put('{');
+        for (Value::ConstMemberIterator i = scene.MemberBegin(), e = scene.MemberEnd(); i != e; ++i) {
+            if (((flags & kHasLights) && !strcmp(i->name.GetString(), "lights")) ||
+                ((flags & kHasObjects) && !strcmp(i->name.GetString(), "objects")) ||
+                ((flags & kHasMaterials) && !strcmp(i->name.GetString(), "materials")))
+                continue;
+            w.member(*i, first);
+            first = false;
+        }
+        w.put('}');
+    }
+    uint64_t settingsLength = mSettings.size();
+    mSettings.push_back('\0');
+
+    Header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, kMagic, sizeof h.magic);
+    h.version = ZBinary::kVersion;
+    h.flags = flags;
+
+    out.assign(sizeof h, 0);
+    section(out, h.settings, mSettings, settingsLength);
+    section(out, h.lights, mLights, mLights.empty() ? 0 : mLights.size() - 1);
+    section(out, h.objects, mObjects, mObjects.empty() ? 0 : mObjects.size() - 1);
+    section(out, h.materials, mMaterials, mMaterials.empty() ? 0 : mMaterials.size() - 1);
+    section(out, h.outcomes, mOutcomes, mOutcomes.empty() ? 0 : mOutcomes.size() - 1);
+    section(out, h.values, mValues, mValues.size());
+    section(out, h.pairs, mPairs, mPairs.size() / 2);
+    section(out, h.strings, mStrings, mStrings.size());
+    memcpy(&out[0], &h, sizeof h);
+
+    return true;
+}
+
+
+/*
+ * Decoder: binary to JSON DOM. Everything read from the file is bounds-checked,
+ * so a truncated or corrupt file produces an error rather than a crash.
+ */
+
+class Decoder {
+public:
+    Decoder(const char *data, size_t length, Document &doc, std::ostream &err)
+        : mData(data), mLength(length), mDoc(doc), mAllocator(doc.GetAllocator()), mError(err) {}
+
+    bool run();
+
+private:
+    const char *mData;
+    size_t mLength;
+    Document &mDoc;
+    Allocator &mAllocator;
+    std::ostream &mError;
+    Header mHeader;
+
+    const uint64_t *mValues;
+    const double *mPairs;
+    const char *mStrings;
+
+    bool section(const Section &s, size_t itemSize, const char *name);
+    bool index(const Section &s, uint64_t limit, const char *name);
+    bool value(uint64_t d, Value &out);
+    bool tuples(const Section &s, Value &out);
+    bool materials(Value &out);
+    bool stringAt(uint64_t offset, const char *&str);
+};
+
+bool Decoder::section(const Section &s, size_t itemSize, const char *name)
+{
+    if (s.offset < sizeof mHeader || s.offset > mLength || (s.offset & 7) ||
+        s.count > (mLength - s.offset) / itemSize) {
+        mError << "Binary scene: '" << name << "' section is out of range\n";
+        return false;
+    }
+    return true;
+}
+
+bool Decoder::index(const Section &s, uint64_t limit, const char *name)
+{
+    /*
+     * Tuple and material indices have count+1 ascending entries, the last
+     * of which must not point past the end of the table they index.
+     */
+
+    if (s.count == 0)
+        return true;
+
+    Section full = { s.offset, s.count + 1 };
+    if (!section(full, sizeof(uint32_t), name))
+        return false;
+
+    const uint32_t *p = (const uint32_t*) (mData + s.offset);
+    for (uint64_t i = 0; i < s.count; ++i) {
+        if (p[i] > p[i + 1]) {
+            mError << "Binary scene: '" << name << "' index is not sorted\n";
+            return false;
+        }
+    }
+    if (p[s.count] > limit) {
+        mError << "Binary scene: '" << name << "' index is out of range\n";
+        return false;
+    }
+    return true;
+}
+
+bool Decoder::stringAt(uint64_t offset, const char *&str)
+{
+    // The strings section is NUL-terminated, so any offset inside it is safe.
+    if (offset >= mHeader.strings.count) {
+        mError << "Binary scene: string offset out of range\n";
+        return false;
+    }
+    str = mStrings + offset;
+    return true;
+}
+
+bool Decoder::value(uint64_t d, Value &out)
+{
+    if ((d & kBoxMask) != kBoxMask) {
+        double number;
+        memcpy(&number, &d, sizeof number);
+        out.SetDouble(number);
+        return true;
+    }
+
+    uint64_t payload = d & kPayloadMask;
+    const char *str;
+
+    switch ((d >> kTagShift) & kTagMask) {
+
+        case kTagNull:
+            out.SetNull();
+            return true;
+
+        case kTagFalse:
+            out.SetBool(false);
+            return true;
+
+        case kTagTrue:
+            out.SetBool(true);
+            return true;
+
+        case kTagInt:
+            out.SetInt(int32_t(uint32_t(payload)));
+            return true;
+
+        case kTagString:
+            if (!stringAt(payload, str))
+                return false;
+            out.SetString(str, strlen(str));
+            return true;
+
+        case kTagUniform:
+        case kTagBlackbody: {
+            uint64_t index = payload & kPairIndexMask;
+            if (index >= mHeader.pairs.count) {
+                mError << "Binary scene: pair index out of range\n";
+                return false;
+            }
+
+            const double *p = mPairs + index * 2;
+            Value first, second;
+
+            if (payload & kPairFirstInt)
+                first.SetInt(int(p[0]));
+            else
+                first.SetDouble(p[0]);
+
+            if (((d >> kTagShift) & kTagMask) == kTagBlackbody)
+                second.SetString("K", 1);
+            else if (payload & kPairSecondInt)
+                second.SetInt(int(p[1]));
+            else
+                second.SetDouble(p[1]);
+
+            out.SetArray();
+            out.Reserve(2, mAllocator);
+            out.PushBack(first, mAllocator);
+            out.PushBack(second, mAllocator);
+            return true;
+        }
+
+        case kTagJSON: {
+            if (!stringAt(payload, str))
+                return false;
+            Document fragment(&mAllocator);
+            fragment.Parse<0>(str);
+            if (fragment.HasParseError()) {
+                mError << "Binary scene: bad JSON fragment: " << fragment.GetParseError() << "\n";
+                return false;
+            }
+            out = static_cast<Value&>(fragment);
+            return true;
+        }
+    }
+
+    mError << "Binary scene: unknown value descriptor\n";
+    return false;
+}
+
+bool Decoder::tuples(const Section &s, Value &out)
+{
+    const uint32_t *index = (const uint32_t*) (mData + s.offset);
+
+    out.SetArray();
+    out.Reserve(s.count, mAllocator);
+
+    for (uint64_t i = 0; i < s.count; ++i) {
+        Value tuple(rapidjson::kArrayType);
+        tuple.Reserve(index[i + 1] - index[i], mAllocator);
+
+        for (uint32_t j = index[i]; j != index[i + 1]; ++j) {
+            Value v;
+            if (!value(mValues[j], v))
+                return false;
+            tuple.PushBack(v, mAllocator);
+        }
+        out.PushBack(tuple, mAllocator);
+    }
+    return true;
+}
+
+bool Decoder::materials(Value &out)
+{
+    const uint32_t *index = (const uint32_t*) (mData + mHeader.materials.offset);
+    Section outcomes = mHeader.outcomes;
+
+    out.SetArray();
+    out.Reserve(mHeader.materials.count, mAllocator);
+
+    for (uint64_t i = 0; i < mHeader.materials.count; ++i) {
+        // Decode this material's range of outcomes as its own tuple table.
+        Section range = { outcomes.offset + index[i] * sizeof(uint32_t), index[i + 1] - index[i] };
+        Value material;
+        if (!tuples(range, material))
+            return false;
+        out.PushBack(material, mAllocator);
+    }
+    return true;
+}
+
+bool Decoder::run()
+{
+    if (mLength < sizeof mHeader) {
+        mError << "Binary scene: file is truncated\n";
+        return false;
+    }
+
+    memcpy(&mHeader, mData, sizeof mHeader);
+
+    if (memcmp(mHeader.magic, kMagic, sizeof kMagic)) {
+        mError << "Binary scene: bad magic number\n";
+        return false;
+    }
+
+    if (mHeader.version != ZBinary::kVersion) {
+        mError << "Binary scene: unsupported format version " << mHeader.version
+            << " (expected " << ZBinary::kVersion << ")\n";
+        return false;
+    }
+
+    // Text sections need room for their NUL terminator
+    Section settings = { mHeader.settings.offset, mHeader.settings.count + 1 };
+
+    if (!section(settings, 1, "settings") ||
+        !section(mHeader.values, sizeof(uint64_t), "values") ||
+        !section(mHeader.pairs, 2 * sizeof(double), "pairs") ||
+        !section(mHeader.strings, 1, "strings") ||
+        !index(mHeader.lights, mHeader.values.count, "lights") ||
+        !index(mHeader.objects, mHeader.values.count, "objects") ||
+        !index(mHeader.outcomes, mHeader.values.count, "outcomes") ||
+        !index(mHeader.materials, mHeader.outcomes.count, "materials"))
+        return false;
+
+    if (mData[settings.offset + mHeader.settings.count] != '\0' ||
+        (mHeader.strings.count && mData[mHeader.strings.offset + mHeader.strings.count - 1] != '\0')) {
+        mError << "Binary scene: unterminated text section\n";
+        return false;
+    }
+
+    mValues = (const uint64_t*) (mData + mHeader.values.offset);
+    mPairs = (const double*) (mData + mHeader.pairs.offset);
+    mStrings = mData + mHeader.strings.offset;
+
+    mDoc.Parse<0>(mData + settings.offset);
+    if (mDoc.HasParseError() || !mDoc.IsObject()) {
+        mError << "Binary scene: bad settings section\n";
+        return false;
+    }
+
+    if (mHeader.flags & kHasLights) {
+        Value lights;
+        if (!tuples(mHeader.lights, lights))
+            return false;
+        mDoc.AddMember("lights", lights, mAllocator);
+    }
+
+    if (mHeader.flags & kHasObjects) {
+        Value objects;
+        if (!tuples(mHeader.objects, objects))
+            return false;
+        mDoc.AddMember("objects", objects, mAllocator);
+    }
+
+    if (mHeader.flags & kHasMaterials) {
+        Value materials;
+        if (!this->materials(materials))
+            return false;
+        mDoc.AddMember("materials", materials, mAllocator);
+    }
+
+    return true;
+}
+
+}  // namespace
+
+
+bool ZBinary::isBinary(const char *data, size_t length)
+{
+    return length >= sizeof kMagic && !memcmp(data, kMagic, sizeof kMagic);
+}
+
+bool ZBinary::encode(const Value &scene, std::vector<char> &out, std::ostream &err)
+{
+    Encoder e(err);
+    return e.run(scene, out);
+}
+
+bool ZBinary::decode(const char *data, size_t length, Document &doc, std::ostream &err)
+{
+    Decoder d(data, length, doc, err);
+    return d.run();
+}
+
+void ZBinary::writeJSON(const Value &v, FILE *f)
+{
+    std::vector<char> buffer;
+    TextWriter w(buffer, f);
+    w.value(v);
+    w.put('\n');
+}
+
+void ZBinary::writeJSON(const Value &v, std::vector<char> &out)
+{
+    TextWriter w(out);
+    w.value(v);
+}
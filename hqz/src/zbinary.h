@@ -0,0 +1,73 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include "rapidjson/document.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <ostream>
+#include <vector>
+
+
+/**
+ * Compact binary scene format, for scenes too large to parse comfortably as JSON.
+ *
+ * A binary scene holds exactly the same information as its JSON equivalent, and
+ * converts losslessly in both directions. All fields are native-endian, and every
+ * section is 8-byte aligned so the whole file can be memory-mapped and read in place:
+ *
+ *   Header       Magic "HQZB", format version, table flags, and a list of sections
+ *   settings     JSON text for every top-level member except the tables below
+ *   lights       Tuple index: one uint32 offset into 'values' per light, plus an end marker
+ *   objects      Tuple index, as above
+ *   materials    One uint32 offset into 'outcomes' per material, plus an end marker
+ *   outcomes     Tuple index for material outcomes
+ *   values       64-bit sampled-value descriptors
+ *   pairs        Pairs of doubles referenced by uniform and blackbody descriptors
+ *   strings      Pool of NUL-terminated strings and JSON fragments
+ *
+ * A descriptor holding a constant is just the IEEE double. Anything else is boxed
+ * in a negative quiet NaN, which JSON can never produce: bits 48-50 are a type tag
+ * and the low 48 bits are a payload (an integer, or an index into 'pairs' or 'strings').
+ * Values with no dedicated descriptor fall back to an embedded JSON fragment.
+ */
+
+struct ZBinary {
+    typedef rapidjson::Value Value;
+    typedef rapidjson::Document Document;
+
+    static const uint32_t kVersion = 1;
+
+    static bool isBinary(const char *data, size_t length);
+    static bool encode(const Value &scene, std::vector<char> &out, std::ostream &err);
+    static bool decode(const char *data, size_t length, Document &doc, std::ostream &err);
+
+    // Write any JSON value as text, with numbers in their shortest exact form.
+    static void writeJSON(const Value &v, FILE *f);
+    static void writeJSON(const Value &v, std::vector<char> &out);
+};
@@ -0,0 +1,211 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "zcache.h"
+#include "zrender.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+
+struct ZCache::Hash
+{
+    /*
+     * FNV-1a over a canonical encoding of the document. Every value starts
+     * with a type tag, and strings and containers with their length, so
+     * different documents can't encode to the same bytes.
+     */
+
+    uint64_t h;
+
+    Hash() : h(0xcbf29ce484222325ULL) {}
+
+    void bytes(const void *data, size_t length)
+    {
+        const unsigned char *p = (const unsigned char*) data;
+        for (size_t i = 0; i < length; ++i)
+            h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+
+    void tag(char c) { bytes(&c, 1); }
+    void size(uint32_t n) { bytes(&n, sizeof n); }
+
+    void string(const char *s, uint32_t length)
+    {
+        size(length);
+        bytes(s, length);
+    }
+
+    static bool memberLess(const Value::Member *a, const Value::Member *b)
+    {
+        unsigned la = a->name.GetStringLength();
+        unsigned lb = b->name.GetStringLength();
+        int c = memcmp(a->name.GetString(), b->name.GetString(), std::min(la, lb));
+        return c ? c < 0 : la < lb;
+    }
+
+    void value(const Value &v)
+    {
+        switch (v.GetType()) {
+
+            case rapidjson::kNullType:
+                tag('n');
+                break;
+
+            case rapidjson::kFalseType:
+                tag('f');
+                break;
+
+            case rapidjson::kTrueType:
+                tag('t');
+                break;
+
+            case rapidjson::kNumberType: {
+                /*
+                 * All numbers are read as doubles in the end. Rounded to 15
+                 * digits, so the last-bit differences between our JSON parser
+                 * and the binary format don't count. Treat -0 as 0.
+                 */
+
+                char text[32];
+                double d = v.GetDouble();
+                snprintf(text, sizeof text, "%.15g", d == 0 ? 0.0 : d);
+                tag('d');
+                string(text, strlen(text));
+                break;
+            }
+
+            case rapidjson::kStringType:
+                tag('s');
+                string(v.GetString(), v.GetStringLength());
+                break;
+
+            case rapidjson::kArrayType:
+                tag('a');
+                size(v.Size());
+                for (unsigned i = 0, e = v.Size(); i != e; ++i)
+                    value(v[i]);
+                break;
+
+            case rapidjson::kObjectType: {
+                std::vector<const Value::Member*> members;
+                for (Value::ConstMemberIterator i = v.MemberBegin(), e = v.MemberEnd(); i != e; ++i)
+                    members.push_back(&*i);
+                std::sort(members.begin(), members.end(), memberLess);
+
+                tag('o');
+                size(members.size());
+                for (unsigned i = 0; i < members.size(); ++i) {
+                    string(members[i]->name.GetString(), members[i]->name.GetStringLength());
+                    value(members[i]->value);
+                }
+                break;
+            }
+        }
+    }
+};
+
+
+ZCache::ZCache(const char *dir)
+    : mDir(dir)
+{}
+
+uint64_t ZCache::key(const Value &scene)
+{
+    Hash h;
+
+    h.size(ZRender::kRendererVersion);
+    h.size(sizeof(Real));
+    h.value(scene);
+
+    return h.h;
+}
+
+std::string ZCache::path(uint64_t key, const char *kind) const
+{
+    char name[32];
+    snprintf(name, sizeof name, "/%016llx.", (unsigned long long) key);
+    return mDir + name + kind;
+}
+
+bool ZCache::load(uint64_t key, const char *kind, std::vector<unsigned char> &data)
+{
+    FILE *f = fopen(path(key, kind).c_str(), "rb");
+    if (!f)
+        return false;
+
+    data.clear();
+    unsigned char block[64 * 1024];
+    size_t count;
+    while ((count = fread(block, 1, sizeof block, f)) > 0)
+        data.insert(data.end(), block, block + count);
+
+    bool ok = !ferror(f) && !data.empty();
+    fclose(f);
+    return ok;
+}
+
+bool ZCache::store(uint64_t key, const char *kind, const void *data, size_t length)
+{
+    if (mkdir(mDir.c_str(), 0777) && errno != EEXIST)
+        return false;
+
+    // Unique temporary name in the same directory, so the rename is atomic
+    std::string temp = mDir + "/.tmp-XXXXXX";
+    int fd = mkstemp(&temp[0]);
+    if (fd < 0)
+        return false;
+
+    const char *p = (const char*) data;
+    size_t remaining = length;
+    while (remaining) {
+        ssize_t count = write(fd, p, remaining);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        p += count;
+        remaining -= count;
+    }
+
+    // mkstemp() makes a private file. Cached frames are as readable as any other output.
+    fchmod(fd, 0644);
+
+    if (close(fd) || remaining || rename(temp.c_str(), path(key, kind).c_str())) {
+        int error = errno;
+        unlink(temp.c_str());
+        errno = error;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include "rapidjson/document.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Content-addressed cache of finished frames, in a directory.
+ *
+ * Entries are keyed by a hash of the scene, taken from the parsed document
+ * rather than the file, so formatting doesn't matter: key order in objects,
+ * number spelling ("1", "1.0", "1e0"), whitespace, and JSON vs. the binary
+ * format all give the same key. Numbers are compared to 15 significant digits. The renderer version and the geometry
+ * precision it was built with are part of the key, so stale frames are never
+ * returned after the renderer changes.
+ *
+ * Each entry is one file, "<key>.<kind>": a PNG, or the raw histogram that
+ * --serve returns. Files are written under a temporary name and renamed into
+ * place, so many processes can share one cache directory, and a reader never
+ * sees a partial file. Nothing is ever evicted; delete files to make room.
+ *
+ * Keys are 64 bits. The chance of two different scenes colliding stays well
+ * under one in a million until there are millions of entries.
+ */
+
+class ZCache {
+public:
+    typedef rapidjson::Value Value;
+
+    ZCache(const char *dir);
+
+    static uint64_t key(const Value &scene);
+
+    // Returns false if there's no such entry, or it can't be read.
+    bool load(uint64_t key, const char *kind, std::vector<unsigned char> &data);
+
+    // Returns false and sets errno if the entry can't be written.
+    bool store(uint64_t key, const char *kind, const void *data, size_t length);
+
+    std::string path(uint64_t key, const char *kind) const;
+
+private:
+    std::string mDir;
+
+    struct Hash;
+};
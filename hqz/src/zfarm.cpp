@@ -0,0 +1,504 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "zfarm.h"
+#include "scenefile.h"
+#include "zrender.h"
+#include "lodepng.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+
+ZFarm::Part::Part()
+    : scene(new SceneFile), render(0) {}
+
+ZFarm::Part::~Part()
+{
+    // The renderer refers to the scene, which refers to our text
+    delete render;
+    delete scene;
+}
+
+ZFarm::ZFarm(const char *input, const char *outputDir, unsigned workers)
+    : mInput(input), mOutputDir(outputDir), mSpool(false), mWorkers(workers),
+      mNextTask(0), mNextWorker(0), mLog(0)
+{
+    pthread_mutex_init(&mLock, 0);
+}
+
+ZFarm::~ZFarm()
+{
+    for (unsigned i = 0; i < mFrames.size(); ++i)
+        delete mFrames[i].merged;
+    if (mLog)
+        fclose(mLog);
+}
+
+int ZFarm::run()
+{
+    struct stat st;
+    if (stat(mInput.c_str(), &st)) {
+        perror(mInput.c_str());
+        return 2;
+    }
+
+    mSpool = S_ISDIR(st.st_mode);
+    if (!(mSpool ? scanSpool() : loadAnimation()))
+        return 2;
+
+    if (mkdir(mOutputDir.c_str(), 0777) && errno != EEXIST) {
+        perror(mOutputDir.c_str());
+        return 3;
+    }
+
+    std::string logPath = mOutputDir + "/farm.log";
+    mLog = fopen(logPath.c_str(), "a");
+    if (!mLog) {
+        perror(logPath.c_str());
+        return 3;
+    }
+
+    plan();
+    fprintf(stderr, "Rendering %d frames with %d workers\n", (int)mFrames.size(), mWorkers);
+
+    std::vector<pthread_t> threads(mWorkers);
+    for (unsigned i = 0; i < threads.size(); ++i) {
+        if (pthread_create(&threads[i], 0, worker, this)) {
+            perror("Error creating worker thread");
+            return 3;
+        }
+    }
+    for (unsigned i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], 0);
+
+    logSummary();
+
+    for (unsigned i = 0; i < mFrames.size(); ++i)
+        if (mFrames[i].status)
+            return mFrames[i].status;
+    return 0;
+}
+
+bool ZFarm::loadAnimation()
+{
+    // One frame per line. Blank lines, like a trailing newline, still count.
+
+    FILE *f = fopen(mInput.c_str(), "r");
+    if (!f) {
+        perror(mInput.c_str());
+        return false;
+    }
+
+    char block[64 * 1024];
+    size_t count;
+    while ((count = fread(block, 1, sizeof block, f)) > 0)
+        mAnimation.insert(mAnimation.end(), block, block + count);
+    bool failed = ferror(f);
+    fclose(f);
+    if (failed) {
+        perror(mInput.c_str());
+        return false;
+    }
+
+    // Output names follow queue-submit: job name, dash, four-digit frame number
+    std::string job = mInput.substr(mInput.find_last_of('/') + 1);
+    job = job.substr(0, job.find_last_of('.'));
+
+    for (size_t offset = 0, line = 0; offset < mAnimation.size(); ++line) {
+        size_t end = std::find(mAnimation.begin() + offset, mAnimation.end(), '\n') - mAnimation.begin();
+
+        bool blank = true;
+        for (size_t i = offset; i < end && blank; ++i)
+            blank = isspace((unsigned char) mAnimation[i]);
+
+        if (!blank) {
+            char number[16];
+            snprintf(number, sizeof number, "-%04d.png", (int)line);
+
+            Frame frame = Frame();
+            frame.name = job + number;
+            frame.offset = offset;
+            frame.length = end - offset;
+            mFrames.push_back(frame);
+        }
+
+        offset = end + 1;
+    }
+
+    return true;
+}
+
+bool ZFarm::scanSpool()
+{
+    // Every scene file not yet claimed, in name order
+
+    DIR *dir = opendir(mInput.c_str());
+    if (!dir) {
+        perror(mInput.c_str());
+        return false;
+    }
+
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        size_t dot = name.find_last_of('.');
+        std::string extension = dot == std::string::npos ? "" : name.substr(dot);
+
+        if (name[0] == '.' || extension == ".working" || extension == ".done" ||
+            extension == ".failed" || extension == ".png")
+            continue;
+        names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (unsigned i = 0; i < names.size(); ++i) {
+        Frame frame = Frame();
+        frame.scenePath = mInput + "/" + names[i];
+        frame.name = names[i].substr(0, names[i].find_last_of('.')) + ".png";
+        mFrames.push_back(frame);
+    }
+
+    return true;
+}
+
+void ZFarm::plan()
+{
+    /*
+     * Decide how many workers to run, and how many parts to split each frame
+     * into. Each part has a histogram of its own, so memory limits the number
+     * of workers whichever way the work is divided.
+     */
+
+    if (!mWorkers)
+        mWorkers = std::max<long>(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+    if (!mFrames.empty()) {
+        Part sample;
+        std::string error;
+        if (!load(mFrames[0], sample, error) && !sample.scene->hasError()) {
+            const rapidjson::Value &resolution = sample.scene->document()["resolution"];
+            if (resolution.IsArray() && resolution.Size() == 2 &&
+                resolution[0u].IsUint() && resolution[1].IsUint()) {
+
+                // Histogram, 8-bit image and PNG, plus a copy of the scene
+                uint64_t pixels = uint64_t(resolution[0u].GetUint()) * resolution[1].GetUint();
+                uint64_t frameBytes = pixels * (kHistogramBytesPerPixel + 6) + sample.text.size() * 2;
+                uint64_t available = availableMemory();
+
+                if (available && frameBytes) {
+                    unsigned fit = std::max<uint64_t>(1, available / frameBytes);
+                    if (fit < mWorkers) {
+                        fprintf(stderr, "Memory for only %d frames at a time\n", fit);
+                        mWorkers = fit;
+                    }
+                }
+            }
+        }
+    }
+
+    unsigned parts = 1;
+    if (!mFrames.empty() && mFrames.size() < mWorkers)
+        parts = mWorkers / mFrames.size();
+
+    for (unsigned i = 0; i < mFrames.size(); ++i) {
+        mFrames[i].parts = parts;
+        for (unsigned part = 0; part < parts; ++part) {
+            Task task = { i, part };
+            mTasks.push_back(task);
+        }
+    }
+
+    mWorkers = std::max<unsigned>(1, std::min<size_t>(mWorkers, mTasks.size()));
+}
+
+void *ZFarm::worker(void *arg)
+{
+    ZFarm *farm = (ZFarm*) arg;
+    Task task;
+
+    pthread_mutex_lock(&farm->mLock);
+    unsigned index = farm->mNextWorker++;
+    pthread_mutex_unlock(&farm->mLock);
+
+    /*
+     * Each part's histogram is allocated and first written by the worker
+     * that traces it, so with HQZ_PIN it lives on that worker's NUMA node.
+     * Parts only meet in merge(), once they're done.
+     */
+    farm->mAffinity.pin(index);
+
+    while (farm->nextTask(task))
+        farm->runTask(task);
+
+    return 0;
+}
+
+bool ZFarm::nextTask(Task &task)
+{
+    /*
+     * Tasks for each frame are consecutive, so the first one to start claims
+     * the frame for all of them. If another farm has already renamed a spool
+     * file, rename() fails and we skip every part of that frame.
+     */
+
+    bool found = false;
+    pthread_mutex_lock(&mLock);
+
+    while (!found && mNextTask < mTasks.size()) {
+        task = mTasks[mNextTask++];
+        Frame &frame = mFrames[task.frame];
+
+        if (!frame.claimed) {
+            frame.claimed = true;
+            frame.startTime = mTimer.elapsed();
+
+            if (mSpool) {
+                std::string working = frame.scenePath + ".working";
+                if (rename(frame.scenePath.c_str(), working.c_str()))
+                    frame.skipped = true;
+                else
+                    frame.scenePath = working;
+            }
+        }
+
+        found = !frame.skipped;
+    }
+
+    pthread_mutex_unlock(&mLock);
+    return found;
+}
+
+int ZFarm::load(const Frame &frame, Part &part, std::string &error)
+{
+    // Parse a private copy of the scene. Returns an hqz exit status.
+
+    if (!mSpool) {
+        part.text.assign(mAnimation.begin() + frame.offset,
+                         mAnimation.begin() + frame.offset + frame.length);
+        part.text.push_back('\0');
+        part.scene->parse(&part.text[0], frame.length);
+
+    } else {
+        FILE *f = fopen(frame.scenePath.c_str(), "r");
+        bool loaded = f && part.scene->load(f);
+        if (f)
+            fclose(f);
+        if (!loaded) {
+            error = strerror(errno);
+            return 2;
+        }
+    }
+
+    if (part.scene->hasError()) {
+        error = part.scene->errorText();
+        return 4;
+    }
+    return 0;
+}
+
+void ZFarm::runTask(const Task &task)
+{
+    Frame &frame = mFrames[task.frame];
+    Part *part = new Part;
+    std::string error;
+    bool contributes = true;
+
+    int status = load(frame, *part, error);
+
+    if (!status) {
+        part->render = new ZRender(part->scene->document());
+        if (part->render->hasError()) {
+            error = std::string("Scene errors:\n") + part->render->errorText();
+            status = 5;
+        }
+    }
+
+    if (!status && frame.parts > 1 && !part->render->splitRays(task.part, frame.parts)) {
+        // This scene can't be split. The first part renders all of it.
+        contributes = task.part == 0;
+    }
+
+    if (!status && contributes) {
+        part->render->renderHistogram();
+        if (part->render->hasError()) {
+            error = std::string("Renderer errors:\n") + part->render->errorText();
+            status = 7;
+        }
+    }
+
+    pthread_mutex_lock(&mLock);
+
+    if (status && !frame.status) {
+        frame.status = status;
+        frame.error = error;
+    }
+
+    if (!status && contributes) {
+        if (frame.merged) {
+            frame.merged->render->merge(*part->render);
+        } else {
+            frame.merged = part;
+            part = 0;
+        }
+    }
+
+    bool done = ++frame.partsDone == frame.parts;
+    pthread_mutex_unlock(&mLock);
+
+    delete part;
+    if (done)
+        finishFrame(frame);
+}
+
+void ZFarm::finishFrame(Frame &frame)
+{
+    // All parts are in. Only this thread touches the frame now, except for logging.
+
+    if (!frame.status && frame.merged) {
+        ZRender &zr = *frame.merged->render;
+        std::vector<unsigned char> pixels;
+        std::vector<unsigned char> png;
+
+        zr.toneMap(pixels);
+        lodepng::encode(png, pixels, zr.width(), zr.height(), LCT_RGB);
+        frame.rays = zr.stats().rays;
+
+        std::string path = mOutputDir + "/" + frame.name;
+        FILE *f = fopen(path.c_str(), "wb");
+        bool written = f && 1 == fwrite(&png[0], png.size(), 1, f);
+        if (f && fclose(f))
+            written = false;
+        if (!written) {
+            frame.status = 6;
+            frame.error = path + ": " + strerror(errno);
+        }
+    }
+
+    delete frame.merged;
+    frame.merged = 0;
+    frame.seconds = mTimer.elapsed() - frame.startTime;
+
+    if (mSpool) {
+        std::string base = frame.scenePath.substr(0, frame.scenePath.size() - strlen(".working"));
+        std::string finished = base + (frame.status ? ".failed" : ".done");
+        rename(frame.scenePath.c_str(), finished.c_str());
+    }
+
+    pthread_mutex_lock(&mLock);
+    if (frame.status)
+        fprintf(stderr, "%s: failed (%d)\n%s", frame.name.c_str(), frame.status, frame.error.c_str());
+    else
+        fprintf(stderr, "%s: %.1f seconds\n", frame.name.c_str(), frame.seconds);
+    logFrame(frame);
+    pthread_mutex_unlock(&mLock);
+}
+
+void ZFarm::logFrame(const Frame &frame)
+{
+    fprintf(mLog, "{\"frame\": ");
+    writeString(mLog, frame.name);
+    fprintf(mLog, ", \"status\": %d, \"seconds\": %.3f, \"rays\": %llu, \"parts\": %d",
+        frame.status, frame.seconds, (unsigned long long) frame.rays, frame.parts);
+    if (frame.status) {
+        fprintf(mLog, ", \"error\": ");
+        writeString(mLog, frame.error);
+    }
+    fprintf(mLog, "}\n");
+    fflush(mLog);
+}
+
+void ZFarm::logSummary()
+{
+    unsigned failed = 0, skipped = 0;
+    for (unsigned i = 0; i < mFrames.size(); ++i) {
+        failed += mFrames[i].status != 0;
+        skipped += mFrames[i].skipped;
+    }
+
+    double seconds = mTimer.elapsed();
+    fprintf(mLog, "{\"summary\": true, \"frames\": %d, \"failed\": %d, \"skipped\": %d, "
+        "\"workers\": %d, \"seconds\": %.3f}\n",
+        (int)mFrames.size(), failed, skipped, mWorkers, seconds);
+    fflush(mLog);
+
+    fprintf(stderr, "Rendered %d frames in %.1f seconds, %d failed, %d skipped\n",
+        (int)mFrames.size() - failed - skipped, seconds, failed, skipped);
+}
+
+uint64_t ZFarm::availableMemory()
+{
+    // Memory we could use without swapping, in bytes. Zero if unknown.
+
+#ifdef __linux__
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[256];
+        unsigned long long kilobytes;
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kilobytes) == 1) {
+                fclose(f);
+                return kilobytes * 1024;
+            }
+        }
+        fclose(f);
+    }
+#endif
+
+#ifdef _SC_AVPHYS_PAGES
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+    if (pages > 0)
+        return uint64_t(pages) * sysconf(_SC_PAGESIZE);
+#endif
+
+    return 0;
+}
+
+void ZFarm::writeString(FILE *f, const std::string &s)
+{
+    // As a JSON string literal
+
+    fputc('"', f);
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
@@ -0,0 +1,150 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include "timer.h"
+#include "affinity.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class SceneFile;
+class ZRender;
+
+
+/**
+ * Local render farm: many frames, one machine, no cloud services.
+ *
+ * Input is either an animation, one JSON scene per line like the files that
+ * queue-submit takes, or a spool directory of scene files. Frames go to a fixed
+ * number of worker threads, and each finished frame is written to the output
+ * directory as a PNG:
+ *
+ *   Animation "path/job.json"     <output>/job-0000.png, job-0001.png, ...
+ *   Spool file "spool/name.json"  <output>/name.png
+ *
+ * Spool files are claimed by renaming them to "name.json.working", and when
+ * the frame is finished they're renamed again to ".done" or ".failed". So
+ * several farms, even on different machines sharing a file system, can work
+ * through the same spool without rendering a frame twice. It's a stand-in for
+ * the SQS and S3 queue used by queue-runner, for small jobs and for testing.
+ *
+ * By default there's one worker per CPU, but never more than there's memory
+ * for, judging by the first frame's resolution. With more frames than workers,
+ * each worker renders whole frames. With fewer, each frame is split into seed
+ * ranges that several workers trace at once, then merged; the image is the
+ * same either way. Only scenes with just a ray limit can be split.
+ *
+ * "<output>/farm.log" gets one line of JSON per frame as it finishes, then a
+ * summary line for the run:
+ *
+ *   {"frame": "job-0001.png", "status": 0, "seconds": 12.5, "rays": 1000000, "parts": 1}
+ *   {"summary": true, "frames": 120, "failed": 0, "skipped": 0, "workers": 8, "seconds": 190.4}
+ *
+ * 'status' is the exit status hqz would have returned for that frame, and
+ * failed frames also have an "error" string. Skipped frames were claimed by
+ * another farm first.
+ */
+
+class ZFarm {
+public:
+    // Zero workers means one per CPU
+    ZFarm(const char *input, const char *outputDir, unsigned workers);
+    ~ZFarm();
+
+    // Returns zero if every frame rendered, or the status of the first failure.
+    int run();
+
+private:
+    // Memory for each pixel of a frame's histogram, for estimating how many fit
+    static const unsigned kHistogramBytesPerPixel = 3 * sizeof(int64_t);
+
+    // One scene, parsed from its own buffer, and a renderer for it
+    struct Part {
+        std::vector<char> text;
+        SceneFile *scene;
+        ZRender *render;
+
+        Part();
+        ~Part();
+    };
+
+    struct Frame {
+        std::string name;           // Output file name
+        std::string scenePath;      // Spool mode: the scene file
+        size_t offset, length;      // Animation mode: this frame's line in mAnimation
+        unsigned parts;
+        unsigned partsDone;
+        bool claimed;
+        bool skipped;               // Claimed by another farm first
+        int status;
+        std::string error;
+        double startTime;
+        double seconds;
+        uint64_t rays;
+        Part *merged;               // Parts traced so far, added together
+    };
+
+    struct Task {
+        unsigned frame;
+        unsigned part;
+    };
+
+    std::string mInput;
+    std::string mOutputDir;
+    bool mSpool;
+    unsigned mWorkers;
+
+    std::vector<char> mAnimation;
+    std::vector<Frame> mFrames;
+    std::vector<Task> mTasks;
+    unsigned mNextTask;
+    unsigned mNextWorker;
+
+    pthread_mutex_t mLock;
+    FILE *mLog;
+    Timer mTimer;
+    Affinity mAffinity;
+
+    bool loadAnimation();
+    bool scanSpool();
+    void plan();
+
+    static void *worker(void *arg);
+    bool nextTask(Task &task);
+    void runTask(const Task &task);
+    int load(const Frame &frame, Part &part, std::string &error);
+    void finishFrame(Frame &frame);
+    void logFrame(const Frame &frame);
+    void logSummary();
+
+    static uint64_t availableMemory();
+    static void writeString(FILE *f, const std::string &s);
+};
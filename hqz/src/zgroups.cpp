@@ -0,0 +1,252 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include "zgroups.h"
+#include "zquadtree.h"
+
+
+ZGroups::ZGroups()
+    : mInstances(0), mGroups(0), mFirstId(0) {}
+
+ZGroups::~ZGroups()
+{
+    clear();
+}
+
+void ZGroups::clear()
+{
+    for (unsigned i = 0; i < mTrees.size(); ++i)
+        delete mTrees[i];
+    mTrees.clear();
+    mBounds.clear();
+    mBase.clear();
+    mTransforms.clear();
+}
+
+void ZGroups::build(const Value &groups, const Value &instances, uint32_t firstId)
+{
+    // Both lists are optional, and were checked by ZRender.
+
+    clear();
+    mInstances = &instances;
+    mGroups = &groups;
+    mFirstId = firstId;
+
+    if (groups.IsArray()) {
+        for (unsigned i = 0; i < groups.Size(); ++i) {
+            const Value &objects = groups[i];
+
+            ZQuadtree *tree = new ZQuadtree();
+            tree->build(objects);
+            mTrees.push_back(tree);
+
+            AABB bounds = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+            for (unsigned j = 0; j < objects.Size(); ++j) {
+                AABB b;
+                ZObject::getBounds(objects[j], b);
+                bounds.left = std::min(bounds.left, b.left);
+                bounds.top = std::min(bounds.top, b.top);
+                bounds.right = std::max(bounds.right, b.right);
+                bounds.bottom = std::max(bounds.bottom, b.bottom);
+            }
+            mBounds.push_back(bounds);
+        }
+    }
+
+    if (instances.IsArray()) {
+        uint32_t id = firstId + instances.Size();
+        for (unsigned i = 0; i < instances.Size(); ++i) {
+            const Value &v = instances[i];
+            mBase.push_back(id);
+            id += objectCount(i);
+
+            Transform t;
+            t.constant = v[1].IsNumber() && v[2].IsNumber() && v[3].IsNumber() && v[4].IsNumber();
+            if (t.constant) {
+                double radians = v[3].GetDouble() * (M_PI / 180.0);
+                t.x = v[1].GetDouble();
+                t.y = v[2].GetDouble();
+                t.cos = cos(radians);
+                t.sin = sin(radians);
+                t.scale = v[4].GetDouble();
+            }
+            mTransforms.push_back(t);
+        }
+    }
+}
+
+void ZGroups::getBounds(unsigned instance, AABB &bounds) const
+{
+    /*
+     * With a constant angle and scale, transform the corners of the group's
+     * box. Otherwise, assume any rotation, and use a circle around the origin
+     * that holds the whole box at the largest scale.
+     */
+
+    const Value &v = (*mInstances)[instance];
+    const AABB &box = mBounds[v[0u].GetUint()];
+
+    Sampler::Bounds x = Sampler::bounds(v[1]);
+    Sampler::Bounds y = Sampler::bounds(v[2]);
+    Sampler::Bounds angle = Sampler::bounds(v[3]);
+    Sampler::Bounds scale = Sampler::bounds(v[4]);
+
+    if (box.right < box.left || box.right >= FLT_MAX * 0.5 || box.bottom >= FLT_MAX * 0.5) {
+        // Empty or unbounded group
+        bounds.left = bounds.top = box.right < box.left ? 0 : -FLT_MAX;
+        bounds.right = bounds.bottom = box.right < box.left ? 0 : FLT_MAX;
+        return;
+    }
+
+    Vec2 corners[4] = {
+        { box.left, box.top }, { box.right, box.top },
+        { box.left, box.bottom }, { box.right, box.bottom }
+    };
+
+    AABB local = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    if (angle.min == angle.max && scale.min == scale.max) {
+        double radians = angle.min * (M_PI / 180.0);
+        double c = cos(radians) * scale.min;
+        double s = sin(radians) * scale.min;
+
+        for (unsigned i = 0; i < 4; ++i) {
+            double px = c * corners[i].x - s * corners[i].y;
+            double py = s * corners[i].x + c * corners[i].y;
+            local.left = std::min<double>(local.left, px);
+            local.right = std::max<double>(local.right, px);
+            local.top = std::min<double>(local.top, py);
+            local.bottom = std::max<double>(local.bottom, py);
+        }
+    } else {
+        double radius = 0;
+        for (unsigned i = 0; i < 4; ++i)
+            radius = std::max<double>(radius, hypot(corners[i].x, corners[i].y));
+        radius *= std::max(fabs(scale.min), fabs(scale.max));
+
+        local.left = local.top = -radius;
+        local.right = local.bottom = radius;
+    }
+
+    bounds.left = x.min + local.left;
+    bounds.right = x.max + local.right;
+    bounds.top = y.min + local.top;
+    bounds.bottom = y.max + local.bottom;
+}
+
+unsigned ZGroups::objectCount(unsigned instance) const
+{
+    return (*mGroups)[(*mInstances)[instance][0u].GetUint()].Size();
+}
+
+bool ZGroups::rayIntersect(unsigned instance, IntersectionData &d, const Sampler &s, uint32_t exclude)
+{
+    const Value &v = (*mInstances)[instance];
+    Transform t = mTransforms[instance];
+
+    if (!t.constant) {
+        ObjectSampler transform(s, mFirstId + instance);
+        double radians = transform.value(v, 3) * (M_PI / 180.0);
+        t.x = transform.value(v, 1);
+        t.y = transform.value(v, 2);
+        t.cos = cos(radians);
+        t.sin = sin(radians);
+        t.scale = transform.value(v, 4);
+    }
+
+    double x = t.x;
+    double y = t.y;
+    double c = t.cos;
+    double sn = t.sin;
+    double scale = t.scale;
+    if (scale == 0.0)
+        return false;
+
+    /*
+     * Into group coordinates: undo the translation, rotate by -angle, and
+     * divide by the scale. The direction stays a unit vector, flipped for a
+     * negative scale, so distances in the group are divided by |scale|.
+     */
+
+    IntersectionData local;
+    double dx = d.ray.origin.x - x;
+    double dy = d.ray.origin.y - y;
+    double flip = scale < 0 ? -1.0 : 1.0;
+
+    local.ray.origin.x = (c * dx + sn * dy) / scale;
+    local.ray.origin.y = (c * dy - sn * dx) / scale;
+    local.ray.setDirection(flip * (c * d.ray.direction.x + sn * d.ray.direction.y),
+                           flip * (c * d.ray.direction.y - sn * d.ray.direction.x));
+    local.ray.color = d.ray.color;
+    local.object = 0;
+    local.id = exclude;
+
+    // Most instances a ray is tested against are near misses
+    unsigned group = v[0u].GetUint();
+    double entry;
+    if (!local.ray.intersectAABB(mBounds[group], entry))
+        return false;
+
+    if (!mTrees[group]->rayIntersect(local, s, mBase[instance]))
+        return false;
+
+    // And back again
+    d.distance = local.distance * fabs(scale);
+    d.point.x = x + scale * (c * local.point.x - sn * local.point.y);
+    d.point.y = y + scale * (sn * local.point.x + c * local.point.y);
+    d.normal.x = c * local.normal.x - sn * local.normal.y;
+    d.normal.y = sn * local.normal.x + c * local.normal.y;
+    d.object = local.object;
+    d.id = local.id;
+    return true;
+}
+
+uint64_t ZGroups::tests() const
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < mTrees.size(); ++i)
+        total += mTrees[i]->tests();
+    return total;
+}
+
+uint64_t ZGroups::nodesVisited() const
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < mTrees.size(); ++i)
+        total += mTrees[i]->counters().nodesVisited;
+    return total;
+}
+
+uint64_t ZGroups::hits() const
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < mTrees.size(); ++i)
+        total += mTrees[i]->counters().hits;
+    return total;
+}
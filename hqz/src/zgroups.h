@@ -0,0 +1,95 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include "rapidjson/document.h"
+#include "ray.h"
+#include "sampler.h"
+#include <vector>
+
+class ZQuadtree;
+
+
+/**
+ * Instanced object groups.
+ *
+ * A scene's "groups" are lists of objects, in the same format as "objects".
+ * Each entry in "instances" places one copy of a group in the scene:
+ *
+ *   [ group, x, y, angle, scale ]
+ *
+ * Points in the group are scaled, rotated by 'angle' degrees, then moved by
+ * (x, y). All but 'group' may be sampled. Each group gets one quadtree, built
+ * once and shared by all of its instances. Rays are moved into an instance's
+ * coordinates to search that tree, and the results are moved back.
+ *
+ * Every object has its own IntersectionData::id, and its own random values.
+ * Scene objects come first, then one id per instance (for sampling its
+ * transform), then a block of ids for each instance's copy of its group.
+ */
+
+class ZGroups {
+public:
+    typedef rapidjson::Value Value;
+
+    ZGroups();
+    ~ZGroups();
+
+    void build(const Value &groups, const Value &instances, uint32_t firstId);
+
+    // Number of instances
+    unsigned size() const { return mBase.size(); }
+
+    // Number of objects in an instance's group
+    unsigned objectCount(unsigned instance) const;
+
+    void getBounds(unsigned instance, AABB &bounds) const;
+    bool rayIntersect(unsigned instance, IntersectionData &d, const Sampler &s, uint32_t exclude);
+
+    // Totals over all group trees
+    uint64_t tests() const;
+    uint64_t nodesVisited() const;
+    uint64_t hits() const;
+
+private:
+    // Instance placement, precomputed when none of it is sampled
+    struct Transform {
+        bool constant;
+        double x, y, cos, sin, scale;
+    };
+
+    const Value *mInstances;
+    const Value *mGroups;
+    uint32_t mFirstId;
+    std::vector<ZQuadtree*> mTrees;         // One per group
+    std::vector<AABB> mBounds;              // One per group
+    std::vector<uint32_t> mBase;            // First object id, per instance
+    std::vector<Transform> mTransforms;     // Per instance
+
+    void clear();
+};
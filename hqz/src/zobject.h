@@ -40,12 +40,20 @@
 struct ZObject {
     typedef rapidjson::Value Value;
 
-    static bool rayIntersect(const Value &object, IntersectionData &d, Sampler &s);
+    static bool rayIntersect(const Value &object, IntersectionData &d, const ObjectSampler &s);
     static void getBounds(const Value &object, AABB &bounds);
+
+    // Can a ray leaving this object hit it again? Only curves.
+    static bool isCurved(const Value &object) {
+        return object.Size() == 6 || object.Size() == 8;
+    }
+
+private:
+    static void arcExtent(double start, double sweep, AABB &unit);
 };
 
 
-inline bool ZObject::rayIntersect(const Value &object, IntersectionData &d, Sampler &s)
+inline bool ZObject::rayIntersect(const Value &object, IntersectionData &d, const ObjectSampler &s)
 {
     /*
      * Does this ray intersect a specific object? This samples the object once,
@@ -60,8 +68,8 @@ inline bool ZObject::rayIntersect(const Value &object, IntersectionData &d, Samp
         case 5: {
             // Line segment
 
-            Vec2 origin = { s.value(object[1]), s.value(object[2]) };
-            Vec2 delta = { s.value(object[3]), s.value(object[4]) };
+            Vec2 origin = { Real(s.value(object, 1)), Real(s.value(object, 2)) };
+            Vec2 delta = { Real(s.value(object, 3)), Real(s.value(object, 4)) };
 
             if (d.ray.intersectSegment(origin, delta, d.distance)) {
                 d.point = d.ray.pointAtDistance(d.distance);
@@ -75,12 +83,12 @@ inline bool ZObject::rayIntersect(const Value &object, IntersectionData &d, Samp
         case 7: {
             // Line segment with trigonometrically interpolated normals
 
-            Vec2 origin = { s.value(object[1]), s.value(object[2]) };
-            Vec2 delta = { s.value(object[4]), s.value(object[5]) };
+            Vec2 origin = { Real(s.value(object, 1)), Real(s.value(object, 2)) };
+            Vec2 delta = { Real(s.value(object, 4)), Real(s.value(object, 5)) };
             double alpha;
 
             if (d.ray.intersectSegment(origin, delta, d.distance, alpha)) {
-                double degrees = s.value(object[3]) + alpha * s.value(object[6]);
+                double degrees = s.value(object, 3) + alpha * s.value(object, 6);
                 double radians = degrees * (M_PI / 180.0);
                 d.point = d.ray.pointAtDistance(d.distance);
                 d.normal.x = cos(radians);
@@ -89,6 +97,58 @@ inline bool ZObject::rayIntersect(const Value &object, IntersectionData &d, Samp
             }
             break;
         }
+
+        case 6: {
+            // Circular arc
+
+            Vec2 center = { Real(s.value(object, 1)), Real(s.value(object, 2)) };
+            double radius = s.value(object, 3);
+            double start = s.value(object, 4) * (M_PI / 180.0);
+            double sweep = s.value(object, 5) * (M_PI / 180.0);
+
+            if (radius < 0) {
+                // Same arc, mirrored through the center
+                radius = -radius;
+                start += M_PI;
+            }
+
+            if (d.ray.intersectArc(center, radius, start, sweep, d.distance)) {
+                d.point = d.ray.pointAtDistance(d.distance);
+                d.normal.x = d.point.x - center.x;
+                d.normal.y = d.point.y - center.y;
+                return true;
+            }
+            break;
+        }
+
+        case 8: {
+            // Rational quadratic Bezier curve
+
+            Vec2 p0 = { Real(s.value(object, 1)), Real(s.value(object, 2)) };
+            Vec2 p1 = { Real(s.value(object, 3)), Real(s.value(object, 4)) };
+            Vec2 p2 = { Real(s.value(object, 5)), Real(s.value(object, 6)) };
+            double w = s.value(object, 7);
+            double t;
+
+            if (d.ray.intersectQuadratic(p0, p1, p2, w, d.distance, d.point, t)) {
+                /*
+                 * The tangent is the derivative of N(t) / D(t). Up to a positive
+                 * factor of 1 / D(t), that's N'(t) - point * D'(t). The normal is
+                 * perpendicular to it.
+                 */
+
+                double u = 1.0 - t;
+                double dn0 = -2.0 * u;
+                double dn1 = 2.0 * w * (u - t);
+                double dn2 = 2.0 * t;
+                double dd = dn0 + dn1 + dn2;
+
+                d.normal.x = -(dn0 * p0.y + dn1 * p1.y + dn2 * p2.y - d.point.y * dd);
+                d.normal.y = dn0 * p0.x + dn1 * p1.x + dn2 * p2.x - d.point.x * dd;
+                return true;
+            }
+            break;
+        }
     }
 
     return false;
@@ -130,6 +190,58 @@ inline void ZObject::getBounds(const Value &object, AABB &bounds)
             break;
         }
 
+        case 6: {
+            // Circular arc. With constant angles we know exactly which part of
+            // the circle it covers; otherwise, assume the whole circle.
+
+            Sampler::Bounds cx = Sampler::bounds(object[1]);
+            Sampler::Bounds cy = Sampler::bounds(object[2]);
+            Sampler::Bounds r = Sampler::bounds(object[3]);
+            Sampler::Bounds start = Sampler::bounds(object[4]);
+            Sampler::Bounds sweep = Sampler::bounds(object[5]);
+
+            AABB unit = { -1, -1, 1, 1 };
+            if (start.min == start.max && sweep.min == sweep.max)
+                arcExtent(start.min * (M_PI / 180.0), sweep.min * (M_PI / 180.0), unit);
+
+            // Scale by either extreme of the radius, which may even be negative
+            bounds.left = cx.min + std::min(std::min(r.min * unit.left, r.max * unit.left),
+                                            std::min(r.min * unit.right, r.max * unit.right));
+            bounds.right = cx.max + std::max(std::max(r.min * unit.left, r.max * unit.left),
+                                             std::max(r.min * unit.right, r.max * unit.right));
+            bounds.top = cy.min + std::min(std::min(r.min * unit.top, r.max * unit.top),
+                                           std::min(r.min * unit.bottom, r.max * unit.bottom));
+            bounds.bottom = cy.max + std::max(std::max(r.min * unit.top, r.max * unit.top),
+                                              std::max(r.min * unit.bottom, r.max * unit.bottom));
+
+            break;
+        }
+
+        case 8: {
+            // Rational quadratic Bezier. With positive weights the curve stays
+            // inside its control points' hull; otherwise it can go anywhere.
+
+            if (Sampler::bounds(object[7]).min <= 0) {
+                bounds.left = bounds.top = -FLT_MAX;
+                bounds.right = bounds.bottom = FLT_MAX;
+                break;
+            }
+
+            bounds.left = bounds.top = FLT_MAX;
+            bounds.right = bounds.bottom = -FLT_MAX;
+
+            for (unsigned i = 1; i < 7; i += 2) {
+                Sampler::Bounds x = Sampler::bounds(object[i]);
+                Sampler::Bounds y = Sampler::bounds(object[i + 1]);
+                bounds.left = std::min(bounds.left, Real(x.min));
+                bounds.right = std::max(bounds.right, Real(x.max));
+                bounds.top = std::min(bounds.top, Real(y.min));
+                bounds.bottom = std::max(bounds.bottom, Real(y.max));
+            }
+
+            break;
+        }
+
         default: {
             // Unsupported
 
@@ -138,3 +250,34 @@ inline void ZObject::getBounds(const Value &object, AABB &bounds)
         }
     }
 }
+
+inline void ZObject::arcExtent(double start, double sweep, AABB &unit)
+{
+    /*
+     * Bounds of an arc of the unit circle: its two endpoints, plus each
+     * axis crossing (0, 90, 180, 270 degrees) that falls inside the sweep.
+     */
+
+    if (fabs(sweep) >= 2.0 * M_PI)
+        return;
+
+    if (sweep < 0) {
+        start += sweep;
+        sweep = -sweep;
+    }
+
+    double end = start + sweep;
+    unit.left = std::min(cos(start), cos(end));
+    unit.right = std::max(cos(start), cos(end));
+    unit.top = std::min(sin(start), sin(end));
+    unit.bottom = std::max(sin(start), sin(end));
+
+    for (int k = int(ceil(start / (0.5 * M_PI))); k * 0.5 * M_PI <= end; ++k) {
+        switch (k & 3) {
+            case 0: unit.right = 1; break;
+            case 1: unit.bottom = 1; break;
+            case 2: unit.left = -1; break;
+            case 3: unit.top = -1; break;
+        }
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include "zprogress.h"
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+
+ZProgress::ZProgress(int fd, double interval)
+    : mFd(fd), mInterval(interval), mNext(0) {}
+
+void ZProgress::write(uint64_t rays, double elapsed, double fraction, bool done)
+{
+    if (mFd < 0)
+        return;
+
+    char line[256];
+    char percent[32] = "null";
+    char eta[32] = "null";
+    double rate = elapsed > 0 ? rays / elapsed : 0;
+
+    if (fraction >= 0) {
+        snprintf(percent, sizeof percent, "%.2f", 100.0 * fraction);
+        if (done || fraction >= 1.0)
+            snprintf(eta, sizeof eta, "0");
+        else if (fraction > 0)
+            snprintf(eta, sizeof eta, "%.1f", elapsed * (1.0 - fraction) / fraction);
+    }
+
+    int length = snprintf(line, sizeof line,
+        "{\"rays\": %llu, \"percent\": %s, \"raysPerSecond\": %.0f, \"elapsed\": %.3f, "
+        "\"eta\": %s, \"rss\": %llu, \"done\": %s}\n",
+        (unsigned long long) rays, percent, rate, elapsed,
+        eta, (unsigned long long) residentBytes(), done ? "true" : "false");
+
+    // One write per line, so readers never see a partial line from us
+    const char *p = line;
+    while (length > 0) {
+        ssize_t count = ::write(mFd, p, length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0) {
+            mFd = -1;
+            return;
+        }
+        p += count;
+        length -= count;
+    }
+
+    mNext = elapsed + mInterval;
+}
+
+uint64_t ZProgress::residentBytes()
+{
+    // Current resident set size where we can get it cheaply; otherwise the peak.
+
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        unsigned long long size, resident;
+        int fields = fscanf(f, "%llu %llu", &size, &resident);
+        fclose(f);
+        if (fields == 2)
+            return resident * sysconf(_SC_PAGESIZE);
+    }
+#endif
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+}
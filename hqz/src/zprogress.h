@@ -0,0 +1,72 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include <stdint.h>
+#include "timer.h"
+
+
+/**
+ * Machine-readable progress for a running render, written to a file
+ * descriptor as one JSON object per line:
+ *
+ *   {"rays": 1250000, "percent": 12.5, "raysPerSecond": 104166, "elapsed": 12.0,
+ *    "eta": 84.0, "rss": 23068672, "done": false}
+ *
+ * 'percent' is of the ray or time budget, whichever is further along. With only
+ * a noise target there's no way to know, so 'percent' and 'eta' are null. Times
+ * are in seconds, 'rss' is the resident set size in bytes, and the last line,
+ * written once all rays are traced, has "done": true.
+ *
+ * Lines are written at most once per interval, so the cost is a clock read
+ * per batch of rays. If the reader goes away, we stop writing.
+ */
+
+class ZProgress {
+public:
+    ZProgress(int fd, double interval = 1.0);
+
+    // 'fraction' of the budget used so far, or negative if unknown
+    void update(uint64_t rays, double elapsed, double fraction) {
+        if (elapsed >= mNext)
+            write(rays, elapsed, fraction, false);
+    }
+
+    void finish(uint64_t rays, double elapsed) {
+        write(rays, elapsed, 1.0, true);
+    }
+
+    static uint64_t residentBytes();
+
+private:
+    int mFd;
+    double mInterval;
+    double mNext;
+
+    void write(uint64_t rays, double elapsed, double fraction, bool done);
+};
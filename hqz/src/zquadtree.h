@@ -30,8 +30,15 @@
 #include "ray.h"
 #include "sampler.h"
 #include "zobject.h"
+#include "zgroups.h"
+#include "counters.h"
+#include "hugepages.h"
+#include <pthread.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <cfloat>
+#include <string.h>
+#include <algorithm>
 #include <vector>
 
 
@@ -39,36 +46,92 @@ class ZQuadtree {
 public:
     typedef rapidjson::Value Value;
     typedef uint32_t Index;
-    typedef std::vector<Index> IndexArray;
+    typedef std::vector<Index, HugePageAllocator<Index> > IndexArray;
+    typedef std::vector<AABB, HugePageAllocator<AABB> > BoundsArray;
 
-    void build(const Value &objects);
-    bool rayIntersect(IntersectionData &d, Sampler &s);
+    /*
+     * The tree holds 'objects', followed by any instances from 'groups'.
+     * Objects are numbered from 'base' for IntersectionData::id, so that
+     * trees shared by several instances can give each copy its own ids.
+     */
+    void build(const Value &objects, ZGroups *groups = 0);
+    bool rayIntersect(IntersectionData &d, const Sampler &s, uint32_t base = 0);
 
     struct Visitor;
 
+    // Traversal work since build(). Only with HQZ_STATS.
+    struct Counters {
+        uint64_t nodesVisited;
+        uint64_t hits;
+    };
+
+    const Counters &counters() const { return mCounters; }
+
+    // Object intersection tests since build(). Always counted, for cost heatmaps.
+    uint64_t tests() const { return mTests; }
+
+    // The shape of the tree, for judging how well it fits the scene.
+    struct Report {
+        // Leaves by object count, bucketed like Stats::Counters::bounces
+        static const unsigned kLeafBuckets = 6;
+
+        unsigned objects;
+        unsigned nodes;
+        unsigned leaves;
+        unsigned depth;                     // Deepest leaf; the root is 0
+        unsigned maxLeafObjects;
+        unsigned leafSizes[kLeafBuckets];
+        unsigned innerObjects;              // Held by nodes that also have children
+        unsigned unboundedObjects;          // No finite bounding box; always in the root
+
+        // Surface area heuristic: expected node visits plus intersection tests
+        // for a random line through the scene. Without a tree it would be 'objects'.
+        double sahCost;
+    };
+
+    void report(Report &r);
+
 private:
 
     struct Node
     {
-        // Split threshold for number of objects in one node.
+        // Split threshold for number of objects in one node. Instances
+        // count as the number of objects in their group.
         static const unsigned kSplitThreshold = 16;
 
-        Node() : split(0) {
+        Node() : begin(0), end(0), split(0) {
             children[0] = 0;
             children[1] = 0;
         }
 
-        IndexArray objects;     // Objects that don't fully fit in either child
-        double split;           // Split location
+        Index begin, end;       // Objects that don't fully fit in either child, in mIndices
+        Real split;             // Split location
         Node *children[2];      // [ < split, >= split ]
     };
 
+    // Subtrees with at least this many objects may be built on another thread
+    static const unsigned kParallelThreshold = 1 << 14;
+
     Node mRoot;
     const Value *mObjects;
-
-    bool rayIntersect(IntersectionData &d, Sampler &s, Visitor &v);
-    void split(Visitor &v);
+    ZGroups *mGroups;
+    IndexArray mIndices;        // Every node's objects, each node a contiguous range
+    BoundsArray mBounds;        // By object index, computed once per build()
+    Counters mCounters;
+    uint64_t mTests;
+
+    struct Task;
+    struct Stays;
+    struct InFirst;
+
+    bool rayIntersect(IntersectionData &d, const Sampler &s, Visitor &v, uint32_t exclude, uint32_t base);
+    void getBounds(Index index, AABB &bounds);
+    void computeBounds(Index begin, Index end, unsigned threads);
+    void split(Visitor &v, unsigned threads);
     double splitPosition(Visitor &v);
+    static void *runTask(void *arg);
+    void report(Report &r, Visitor &v, const AABB &scene, unsigned depth);
+    static double perimeter(const AABB &bounds, const AABB &clip);
 };
 
 
@@ -126,31 +189,114 @@ struct ZQuadtree::Visitor
 };
 
 
-inline void ZQuadtree::build(const Value &objects)
+// One piece of build() for another thread: some bounds, or a subtree
+struct ZQuadtree::Task
+{
+    ZQuadtree *tree;
+    Visitor v;              // Subtree to split, or none
+    Index begin, end;       // Otherwise, objects to compute bounds for
+    unsigned threads;
+};
+
+// Partition predicates for split()
+struct ZQuadtree::Stays
+{
+    const AABB *bounds;
+    AABB first, second;
+
+    bool operator() (Index i) const {
+        return !first.contains(bounds[i]) && !second.contains(bounds[i]);
+    }
+};
+
+struct ZQuadtree::InFirst
+{
+    const AABB *bounds;
+    AABB first;
+
+    bool operator() (Index i) const {
+        return first.contains(bounds[i]);
+    }
+};
+
+inline void ZQuadtree::build(const Value &objects, ZGroups *groups)
 {
     /*
-     * Start out with all items in the root node
+     * Every object's bounds are needed at each level of the tree, and
+     * computing them means sampling JSON, so do it once up front.
+     * Then start out with all items in the root node.
      */
 
     mObjects = &objects;
-    mRoot.objects.resize(objects.Size());
-    for (unsigned i = 0; i < objects.Size(); ++i)
-        mRoot.objects[i] = i;
+    mGroups = groups;
+    memset(&mCounters, 0, sizeof mCounters);
+    mTests = 0;
+
+    Index count = objects.Size() + (groups ? groups->size() : 0);
+    unsigned threads = count < kParallelThreshold ? 1 : std::max<long>(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+    mBounds.resize(count);
+    computeBounds(0, count, threads);
+
+    mIndices.resize(count);
+    for (Index i = 0; i < count; ++i)
+        mIndices[i] = i;
+    mRoot.begin = 0;
+    mRoot.end = count;
 
     /*
      * Recursively visit and split each node
      */
 
     Visitor v = Visitor::root(this);
-    split(v);
+    split(v, threads);
+}
+
+inline void ZQuadtree::computeBounds(Index begin, Index end, unsigned threads)
+{
+    // Half the range on a new thread, half here, until we run out of threads.
+
+    if (threads > 1) {
+        Task task = { this, Visitor(), begin + (end - begin) / 2, end, threads / 2 };
+        task.v.current = 0;
+        pthread_t thread;
+
+        if (!pthread_create(&thread, 0, runTask, &task)) {
+            computeBounds(begin, task.begin, threads - threads / 2);
+            pthread_join(thread, 0);
+            return;
+        }
+    }
+
+    for (Index i = begin; i < end; ++i) {
+        if (i < mObjects->Size())
+            ZObject::getBounds((*mObjects)[i], mBounds[i]);
+        else
+            mGroups->getBounds(i - mObjects->Size(), mBounds[i]);
+    }
 }
 
-inline void ZQuadtree::split(Visitor &v)
+inline void *ZQuadtree::runTask(void *arg)
+{
+    Task &task = *(Task*) arg;
+
+    if (task.v)
+        task.tree->split(task.v, task.threads);
+    else
+        task.tree->computeBounds(task.begin, task.end, task.threads);
+
+    return 0;
+}
+
+inline void ZQuadtree::split(Visitor &v, unsigned threads)
 {
     Node &node = *v.current;
 
     // Is this node already small enough?
-    if (node.objects.size() <= Node::kSplitThreshold)
+    unsigned weight = 0;
+    for (Index i = node.begin; i != node.end && weight <= Node::kSplitThreshold; ++i)
+        weight += mIndices[i] < mObjects->Size() ? 1 : mGroups->objectCount(mIndices[i] - mObjects->Size());
+    if (weight <= Node::kSplitThreshold)
         return;
 
     // New children
@@ -161,44 +307,49 @@ inline void ZQuadtree::split(Visitor &v)
     Visitor second = v.second();
 
     /*
-     * Loop through the objects in this node, and move them to
-     * our children if possible.
+     * Partition this node's range into the objects that stay here, then
+     * those that fit in the first child, then the second. The partitions
+     * are stable, so every node sees its objects in the same order.
      */
 
-    unsigned in = 0;
-    unsigned out = 0;
-    unsigned end = node.objects.size();
+    Index *begin = &mIndices[0] + node.begin;
+    Index *end = &mIndices[0] + node.end;
 
-    for (; in != end; ++in) {
-        Index index = node.objects[in];
-        const Value &object = (*mObjects)[index];
+    Stays stays = { &mBounds[0], first.bounds, second.bounds };
+    Index *kept = std::stable_partition(begin, end, stays);
 
-        AABB bounds;
-        ZObject::getBounds(object, bounds);
+    InFirst inFirst = { &mBounds[0], first.bounds };
+    Index *middle = std::stable_partition(kept, end, inFirst);
 
-        if (first.bounds.contains(bounds)) {
-            first.current->objects.push_back(index);
-
-        } else if (second.bounds.contains(bounds)) {
-            second.current->objects.push_back(index);
-
-        } else {
-            // Keep it here
-            node.objects[out++] = index;
-        }
-    }
+    node.end = kept - &mIndices[0];
+    first.current->begin = node.end;
+    first.current->end = second.current->begin = middle - &mIndices[0];
+    second.current->end = end - &mIndices[0];
 
     if (0) {
         printf("Splitting [%f, %f, %f, %f] orig: %d self: %d first: %d second: %d\n",
             v.bounds.left, v.bounds.top, v.bounds.right, v.bounds.bottom,
-            end, out, (int)first.current->objects.size(), (int)second.current->objects.size());
+            int(end - begin), int(kept - begin), int(middle - kept), int(end - middle));
     }
 
-    node.objects.resize(out);
+    /*
+     * Recursively split child nodes. Their ranges don't overlap, so a big
+     * enough subtree can go to another thread with half our thread budget.
+     */
+
+    if (threads > 1 && middle - kept >= kParallelThreshold && end - middle >= kParallelThreshold) {
+        Task task = { this, first, 0, 0, threads / 2 };
+        pthread_t thread;
+
+        if (!pthread_create(&thread, 0, runTask, &task)) {
+            split(second, threads - threads / 2);
+            pthread_join(thread, 0);
+            return;
+        }
+    }
 
-    // Recursively split child nodes    
-    split(first);
-    split(second);
+    split(first, threads);
+    split(second, threads);
 }
 
 inline double ZQuadtree::splitPosition(Visitor &v)
@@ -212,13 +363,9 @@ inline double ZQuadtree::splitPosition(Visitor &v)
     int denominator = 0;
 
     Node &node = *v.current;
-    for (IndexArray::const_iterator i = node.objects.begin(), e = node.objects.end(); i != e; ++i)
+    for (Index i = node.begin; i != node.end; ++i)
     { 
-        Index index = *i;
-        const Value &object = (*mObjects)[index];
-
-        AABB bounds;
-        ZObject::getBounds(object, bounds);
+        const AABB &bounds = mBounds[mIndices[i]];
 
         denominator += 2;
         if (v.axisY)
@@ -230,14 +377,25 @@ inline double ZQuadtree::splitPosition(Visitor &v)
     return numerator / denominator;
 }
 
-inline bool ZQuadtree::rayIntersect(IntersectionData &d, Sampler &s)
+inline void ZQuadtree::getBounds(Index index, AABB &bounds)
+{
+    bounds = mBounds[index];
+}
+
+inline bool ZQuadtree::rayIntersect(IntersectionData &d, const Sampler &s, uint32_t base)
 {
     Visitor v = Visitor::root(this);
-    return rayIntersect(d, s, v);
+    return rayIntersect(d, s, v, d.id, base);
 }
 
-inline bool ZQuadtree::rayIntersect(IntersectionData &d, Sampler &s, Visitor &v)
+inline bool ZQuadtree::rayIntersect(IntersectionData &d, const Sampler &s, Visitor &v,
+    uint32_t exclude, uint32_t base)
 {
+    /*
+     * 'd' is reused as scratch space for child nodes, so the object to
+     * exclude is passed separately.
+     */
+
     // Swappable buffers for keeping track of the closest intersection
     IntersectionData intersections[2];
     intersections[0] = intersections[1] = d;
@@ -246,40 +404,64 @@ inline bool ZQuadtree::rayIntersect(IntersectionData &d, Sampler &s, Visitor &v)
     IntersectionData *scratch = &intersections[1];
     bool result = false;
 
-    Visitor first = v.first();
-    double firstClosest = 0;
-    bool firstHit = first && d.ray.intersectAABB(first.bounds, firstClosest);
+    HQZ_COUNT(mCounters.nodesVisited);
 
+    // Nodes are split into two children or none, so both are tested at once.
+    Visitor first = v.first();
     Visitor second = v.second();
-    double secondClosest = 0;
-    bool secondHit = second && d.ray.intersectAABB(second.bounds, secondClosest);
+    double childClosest[2] = { 0, 0 };
+    unsigned childHits = first ? d.ray.intersectAABB(first.bounds, second.bounds, childClosest) : 0;
+    bool firstHit = childHits & 1;
+    bool secondHit = childHits & 2;
+    double firstClosest = childClosest[0];
+    double secondClosest = childClosest[1];
 
     // Try local objects. These could be leaves in the tree, or larger objects that
     // don't fully fit inside a subtree's AABB.
 
     Node &node = *v.current;
-    for (IndexArray::const_iterator i = node.objects.begin(), e = node.objects.end(); i != e; ++i)
+    for (IndexArray::const_iterator i = mIndices.begin() + node.begin, e = mIndices.begin() + node.end; i != e; ++i)
     { 
         Index index = *i;
+
+        if (index >= mObjects->Size()) {
+            // An instance. Its group has a tree of its own, which sets 'object' and 'id'.
+
+            if (!mGroups->rayIntersect(index - mObjects->Size(), *scratch, s, exclude))
+                continue;
+
+            if (scratch->distance < closest->distance) {
+                std::swap(closest, scratch);
+                result = true;
+            }
+            continue;
+        }
+
         const Value &object = (*mObjects)[index];
+        uint32_t id = base + index;
 
-        if (d.object == &object)
+        if (id == exclude && !ZObject::isCurved(object))
             continue;
 
         /*
-         * Create a nested per-object sampler which allows us to test objects
-         * in an arbitrary order without affecting the stream of values produced by
-         * the parent sampler. The sampler must be perturbed in a way specific to
-         * each object, however, since it's important not to allow correlation in
-         * the random values used by different objects.
+         * Objects draw their random values from an ObjectSampler, which depends
+         * only on the ray, the bounce, and the object. We can test objects in an
+         * arbitrary order without affecting the stream of values produced by the
+         * parent sampler, and without correlation between different objects.
          */
 
-        Sampler tempSampler = s;
-        tempSampler.mRandom.remix(index);
+        ObjectSampler objectSampler(s, id);
+        mTests++;
+
+        if (!ZObject::rayIntersect(object, *scratch, objectSampler))
+            continue;
+
+        HQZ_COUNT(mCounters.hits);
 
-        if (ZObject::rayIntersect(object, *scratch, tempSampler) && scratch->distance < closest->distance) {
+        if (scratch->distance < closest->distance) {
             std::swap(closest, scratch);
             closest->object = &object;
+            closest->id = id;
             result = true;
         }
     }
@@ -288,13 +470,13 @@ inline bool ZQuadtree::rayIntersect(IntersectionData &d, Sampler &s, Visitor &v)
     if (firstClosest < secondClosest) {
 
         if (firstHit && firstClosest < closest->distance &&
-            rayIntersect(*scratch, s, first) && scratch->distance < closest->distance) {
+            rayIntersect(*scratch, s, first, exclude, base) && scratch->distance < closest->distance) {
             std::swap(closest, scratch);
             result = true;
         }
 
         if (secondHit && secondClosest < closest->distance &&
-            rayIntersect(*scratch, s, second) && scratch->distance < closest->distance) {
+            rayIntersect(*scratch, s, second, exclude, base) && scratch->distance < closest->distance) {
             std::swap(closest, scratch);
             result = true;
         }
@@ -302,13 +484,13 @@ inline bool ZQuadtree::rayIntersect(IntersectionData &d, Sampler &s, Visitor &v)
     } else {
 
         if (secondHit && secondClosest < closest->distance &&
-            rayIntersect(*scratch, s, second) && scratch->distance < closest->distance) {
+            rayIntersect(*scratch, s, second, exclude, base) && scratch->distance < closest->distance) {
             std::swap(closest, scratch);
             result = true;
         }
 
         if (firstHit && firstClosest < closest->distance &&
-            rayIntersect(*scratch, s, first) && scratch->distance < closest->distance) {
+            rayIntersect(*scratch, s, first, exclude, base) && scratch->distance < closest->distance) {
             std::swap(closest, scratch);
             result = true;
         }
@@ -319,3 +501,74 @@ inline bool ZQuadtree::rayIntersect(IntersectionData &d, Sampler &s, Visitor &v)
     }
     return result;
 }
+
+inline void ZQuadtree::report(Report &r)
+{
+    /*
+     * The cost estimate is the surface area heuristic, in 2D: a random line
+     * crosses a convex region with probability proportional to its perimeter.
+     * The tree's root is unbounded, so node bounds are clipped to the box
+     * around all bounded objects first.
+     */
+
+    memset(&r, 0, sizeof r);
+    r.objects = mObjects->Size() + (mGroups ? mGroups->size() : 0);
+
+    AABB scene = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    for (unsigned i = 0; i < r.objects; ++i) {
+        AABB bounds;
+        getBounds(i, bounds);
+
+        if (bounds.right >= FLT_MAX * 0.5 || bounds.bottom >= FLT_MAX * 0.5) {
+            r.unboundedObjects++;
+            continue;
+        }
+
+        scene.left = std::min(scene.left, bounds.left);
+        scene.top = std::min(scene.top, bounds.top);
+        scene.right = std::max(scene.right, bounds.right);
+        scene.bottom = std::max(scene.bottom, bounds.bottom);
+    }
+
+    Visitor v = Visitor::root(this);
+    report(r, v, scene, 0);
+}
+
+inline void ZQuadtree::report(Report &r, Visitor &v, const AABB &scene, unsigned depth)
+{
+    Node &node = *v.current;
+    unsigned size = node.end - node.begin;
+
+    // Degenerate scenes (one point, or nothing bounded) count every node fully
+    double scenePerimeter = perimeter(scene, scene);
+    double p = scenePerimeter > 0 ? perimeter(v.bounds, scene) / scenePerimeter : 1.0;
+
+    r.nodes++;
+    r.sahCost += p * (1 + size);
+
+    Visitor first = v.first();
+    Visitor second = v.second();
+
+    if (!first && !second) {
+        unsigned bucket = size ? 32 - __builtin_clz(size) : 0;
+        r.leaves++;
+        r.leafSizes[std::min(bucket, Report::kLeafBuckets - 1)]++;
+        r.maxLeafObjects = std::max(r.maxLeafObjects, size);
+        r.depth = std::max(r.depth, depth);
+        return;
+    }
+
+    r.innerObjects += size;
+    if (first) report(r, first, scene, depth + 1);
+    if (second) report(r, second, scene, depth + 1);
+}
+
+inline double ZQuadtree::perimeter(const AABB &bounds, const AABB &clip)
+{
+    // Perimeter of the intersection of two boxes, or zero if they're disjoint.
+
+    double w = std::min(bounds.right, clip.right) - std::max(bounds.left, clip.left);
+    double h = std::min(bounds.bottom, clip.bottom) - std::max(bounds.top, clip.top);
+    return w < 0 || h < 0 ? 0 : 2 * (w + h);
+}
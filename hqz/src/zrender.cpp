@@ -26,9 +26,27 @@
  */
 
 #include <float.h>
-#include <time.h>
+#include <string.h>
+#include <map>
 #include "zrender.h"
 #include "zmaterial.h"
+#include "timer.h"
+#include "noiseestimate.h"
+
+// Longest we'll go between clock checks when there's a time limit, in seconds.
+static const double kTimeCheckInterval = 0.005;
+
+// Noise-targeted stopping: which tiles we judge by, and how much evidence we need first.
+static const double kNoisePercentile = 0.95;
+static const unsigned kMinNoiseRounds = 8;
+
+/*
+ * Russian roulette: past "rrdepth" bounces, a path continues with this probability
+ * and its brightness is divided by it. Once a path is this many times brighter than
+ * it started, it's no longer eligible, which keeps colors well inside integer range.
+ */
+static const double kRouletteSurvival = 0.9;
+static const double kRouletteMaxWeight = 256.0;
 
 
 ZRender::ZRender(const Value &scene)
@@ -37,8 +55,14 @@ ZRender::ZRender(const Value &scene)
     mLights(scene["lights"]),
     mObjects(scene["objects"]),
     mMaterials(scene["materials"]),
-    mLightPower(0.0)
+    mLightPower(0.0),
+    mHeatmapEnabled(false),
+    mProgress(0),
+    mScale(0.0),
+    mExponent(1.0)
 {
+    memset(&mStats, 0, sizeof mStats);
+
     // Optional iteger values
     mSeed = checkInteger(mScene["seed"], "seed");
     mDebug = checkInteger(mScene["debug"], "debug");
@@ -50,11 +74,28 @@ ZRender::ZRender(const Value &scene)
                       checkInteger(resolution[1], "resolution[1]"));
     }
 
+    // Path length limits
+    int maxBounces = checkInteger(mScene["maxbounces"], "maxbounces");
+    int rouletteDepth = checkInteger(mScene["rrdepth"], "rrdepth");
+    if (maxBounces < 0 || rouletteDepth < 0) {
+        mError << "'maxbounces' and 'rrdepth' must not be negative\n";
+    }
+    mMaxBounces = maxBounces > 0 ? maxBounces : kDefaultMaxBounces;
+    mRouletteDepth = std::max(0, rouletteDepth);
+
+    // Optional sampling mode for light emission
+    const Value &sampler = mScene["sampler"];
+    mSobol = sampler.IsString() && !strcmp(sampler.GetString(), "sobol");
+    if (!mSobol && !sampler.IsNull() && !(sampler.IsString() && !strcmp(sampler.GetString(), "random"))) {
+        mError << "'sampler' expected \"random\" or \"sobol\"\n";
+    }
+
     // Check stopping conditions
     mRayLimit = checkNumber(mScene["rays"], "rays");
     mTimeLimit = checkNumber(mScene["timelimit"], "timelimit");
-    if (mRayLimit <= 0.0 && mTimeLimit <= 0.0) {
-        mError << "No stopping conditions set. Expected a ray limit and/or time limit.\n";
+    mNoiseLimit = checkNumber(mScene["noise"], "noise");
+    if (mRayLimit <= 0.0 && mTimeLimit <= 0.0 && mNoiseLimit <= 0.0) {
+        mError << "No stopping conditions set. Expected a ray limit, time limit, and/or noise limit.\n";
     }
 
     // Other cached tuples
@@ -72,26 +113,215 @@ ZRender::ZRender(const Value &scene)
         mError << "Total light power (" << mLightPower << ") must be positive.\n";
     }
 
-    // Check all objects
-    if (checkTuple(mObjects, "objects", 0)) {
-        for (unsigned i = 0; i < mObjects.Size(); ++i) {
-            const Value &object = mObjects[i];
-            if (checkTuple(object, "object", 5)) {
-                checkMaterialID(object[0u]);
-            }
-        }
-    }
+    // Check all objects, and optional instanced groups
+    checkObjects(mObjects, "objects");
+    checkInstances(mScene["groups"], mScene["instances"]);
 
     // Check all materials
     if (checkTuple(mMaterials, "materials", 0)) {
         for (unsigned i = 0; i < mMaterials.Size(); ++i)
             checkMaterialValue(i);
     }
+
+    if (!hasError()) {
+        initAliasTables();
+        initLightSpectra();
+    }
+}
+
+void ZRender::initAliasTables()
+{
+    /*
+     * Scenes with many lights or material outcomes can pick one in constant time
+     * using an alias table, as long as the weights are constants. Short lists keep
+     * the linear scan: it's just as fast, and it keeps the same sequence of random
+     * choices (and so the same noise pattern) that earlier versions rendered.
+     */
+
+    std::vector<double> weights;
+
+    if (mLights.Size() >= kAliasThreshold) {
+        bool constant = true;
+
+        for (unsigned i = 0, e = mLights.Size(); constant && i != e; ++i) {
+            const Value &power = mLights[i][0u];
+            constant = power.IsNumber() && power.GetDouble() >= 0.0;
+            if (constant)
+                weights.push_back(power.GetDouble());
+        }
+
+        if (constant)
+            mLightTable.build(weights);
+    }
+
+    mMaterialTables.resize(mMaterials.Size());
+    for (unsigned id = 0, e = mMaterials.Size(); id != e; ++id) {
+        const Value &material = mMaterials[id];
+        if (material.Size() < kAliasThreshold)
+            continue;
+
+        /*
+         * rayMaterial() takes the first outcome whose running total reaches a
+         * uniform random number in [0,1]. Outcomes past a total of 1 can never be
+         * reached, and anything short of 1 is absorbed. The table gets one extra
+         * entry to represent absorption.
+         */
+
+        bool valid = true;
+        double sum = 0;
+        weights.clear();
+
+        for (unsigned i = 0, f = material.Size(); i != f; ++i) {
+            double w = material[i][0u].GetDouble();
+            if (w < 0.0)
+                valid = false;
+            weights.push_back(std::min(sum + w, 1.0) - std::min(sum, 1.0));
+            sum += w;
+        }
+        weights.push_back(std::max(0.0, 1.0 - sum));
+
+        if (valid)
+            mMaterialTables[id].build(weights);
+    }
+}
+
+void ZRender::initLightSpectra()
+{
+    /*
+     * Rays at invisible wavelengths don't count toward the image, so each light
+     * samples only the visible part of its spectrum. Constant wavelengths are
+     * converted to a color once, and uniform or blackbody distributions get a
+     * VisibleSpectrum table, which needs exactly one random number per ray.
+     * Anything else falls back to drawing and rejecting wavelengths in initRay().
+     *
+     * Blackbody tables are the large ones, so lights share them by temperature.
+     */
+
+    std::map<double, unsigned> blackbodyTables;
+
+    mLightSpectra.resize(mLights.Size());
+    for (unsigned i = 0, e = mLights.Size(); i != e; ++i) {
+        const Value &v = mLights[i][6];
+        LightSpectrum &spectrum = mLightSpectra[i];
+        spectrum.mode = LightSpectrum::kRejection;
+        spectrum.table = 0;
+
+        if (v.IsNumber() || v.IsNull()) {
+            // Constant. Null samples as zero, which is never visible.
+            spectrum.color.setWavelength(v.IsNumber() ? v.GetDouble() : 0.0);
+            spectrum.mode = spectrum.color.isVisible()
+                ? LightSpectrum::kConstant : LightSpectrum::kInvisible;
+
+        } else if (v.IsArray() && v.Size() == 2 && v[0u].IsNumber() && v[1].IsNumber()) {
+            // Uniform
+            VisibleSpectrum table;
+            if (table.initUniform(v[0u].GetDouble(), v[1].GetDouble())) {
+                spectrum.mode = LightSpectrum::kTable;
+                spectrum.table = mSpectra.size();
+                mSpectra.push_back(table);
+            } else {
+                spectrum.mode = LightSpectrum::kInvisible;
+            }
+
+        } else if (v.IsArray() && v.Size() == 2 && v[0u].IsNumber() && v[1].IsString()
+            && v[1].GetStringLength() == 1 && v[1].GetString()[0] == 'K') {
+            // Blackbody
+            double temperature = v[0u].GetDouble();
+            std::map<double, unsigned>::iterator shared = blackbodyTables.find(temperature);
+
+            if (shared != blackbodyTables.end()) {
+                spectrum.mode = LightSpectrum::kTable;
+                spectrum.table = shared->second;
+            } else {
+                VisibleSpectrum table;
+                if (table.initBlackbody(temperature)) {
+                    spectrum.mode = LightSpectrum::kTable;
+                    spectrum.table = mSpectra.size();
+                    blackbodyTables[temperature] = spectrum.table;
+                    mSpectra.push_back(table);
+                } else {
+                    spectrum.mode = LightSpectrum::kInvisible;
+                }
+            }
+        }
+    }
 }
 
 void ZRender::render(std::vector<unsigned char> &pixels)
 {
-    mQuadtree.build(mObjects);
+    renderHistogram();
+    toneMap(pixels);
+}
+
+void ZRender::toneMap(std::vector<unsigned char> &pixels)
+{
+    Timer timer;
+    mImage.render(pixels, mScale, mExponent);
+    mStats.toneMapTime = timer.elapsed();
+}
+
+bool ZRender::splitRays(unsigned part, unsigned parts)
+{
+    if (mTimeLimit > 0 || mNoiseLimit > 0 || mRayLimit <= 0 || part >= parts)
+        return false;
+
+    // Seeds [first, end) of the scene's range belong to this part
+    uint64_t total = mRayLimit;
+    uint64_t first = total * part / parts;
+    uint64_t end = total * (part + 1) / parts;
+
+    mSeed += first;
+    mRayLimit = end - first;
+    return true;
+}
+
+void ZRender::merge(const ZRender &part)
+{
+    mImage.add(part.mImage);
+    mStats.rays += part.mStats.rays;
+    mStats.segments += part.mStats.segments;
+    mStats.traceTime += part.mStats.traceTime;
+    mStats.bounceLimitHits += part.mStats.bounceLimitHits;
+    mStats.rouletteKills += part.mStats.rouletteKills;
+    updateScale();
+}
+
+void ZRender::enableHeatmap()
+{
+    mHeatmapEnabled = true;
+    mHeatmap.resize(width(), height());
+}
+
+void ZRender::heatmap(std::vector<unsigned char> &pixels)
+{
+    /*
+     * Every ray starts at a light, so the lights themselves are far brighter
+     * than anything else. Scale so the 99th percentile of the pixels that were
+     * drawn at all is white, and use a square root to keep cheap areas visible.
+     */
+
+    std::vector<int64_t> drawn;
+    for (size_t i = 0; i < mHeatmap.size(); i += HistogramImage::channels())
+        if (mHeatmap.counts()[i] > 0)
+            drawn.push_back(mHeatmap.counts()[i]);
+
+    int64_t white = 1;
+    if (!drawn.empty()) {
+        std::vector<int64_t>::iterator percentile = drawn.begin() + drawn.size() * 99 / 100;
+        std::nth_element(drawn.begin(), percentile, drawn.end());
+        white = std::max<int64_t>(white, *percentile);
+    }
+
+    mHeatmap.render(pixels, 1.0 / white, 0.5);
+}
+
+void ZRender::renderHistogram()
+{
+    Timer timer;
+    mGroups.build(mScene["groups"], mScene["instances"], mObjects.Size());
+    mQuadtree.build(mObjects, &mGroups);
+    mStats.buildTime = timer.elapsed();
+    mQuadtree.report(mStats.quadtree);
 
     /*
      * Debug flags
@@ -106,8 +336,22 @@ void ZRender::render(std::vector<unsigned char> &pixels)
      * Trace rays!
      */
 
+    timer.reset();
     uint64_t numRays = traceRays();
+    mStats.traceTime = timer.elapsed();
+    mStats.rays = numRays;
+
+    mStats.counters.nodesVisited = mQuadtree.counters().nodesVisited + mGroups.nodesVisited();
+    mStats.counters.intersectionTests = mQuadtree.tests() + mGroups.tests();
+    mStats.counters.hits = mQuadtree.counters().hits + mGroups.hits();
+    mStats.counters.segmentsRasterized = mImage.counters().rasterized;
+    mStats.counters.segmentsClipped = mImage.counters().lines - mImage.counters().rasterized;
 
+    updateScale();
+}
+
+void ZRender::updateScale()
+{
     /*
      * Optional gamma correction. Defaults to linear, for compatibility with zenphoton.
      */
@@ -125,9 +369,9 @@ void ZRender::render(std::vector<unsigned char> &pixels)
     double exposure = mScene["exposure"].GetDouble();
     double areaScale = sqrt(double(width()) * height() / (1024 * 576));
     double intensityScale = mLightPower / (255.0 * 8192.0);
-    double scale = exp(1.0 + 10.0 * exposure) * areaScale * intensityScale / numRays;
 
-    mImage.render(pixels, scale, 1.0 / gamma);
+    mScale = exp(1.0 + 10.0 * exposure) * areaScale * intensityScale / mStats.rays;
+    mExponent = 1.0 / gamma;
 }
 
 int ZRender::checkInteger(const Value &v, const char *noun)
@@ -197,6 +441,40 @@ bool ZRender::checkMaterialID(const Value &v)
     return true;
 }
 
+void ZRender::checkObjects(const Value &objects, const char *noun)
+{
+    if (checkTuple(objects, noun, 0)) {
+        for (unsigned i = 0; i < objects.Size(); ++i) {
+            const Value &object = objects[i];
+            if (checkTuple(object, "object", 5)) {
+                checkMaterialID(object[0u]);
+            }
+        }
+    }
+}
+
+void ZRender::checkInstances(const Value &groups, const Value &instances)
+{
+    // Both are optional, but instances need groups to refer to.
+
+    if (!groups.IsNull() && checkTuple(groups, "groups", 0)) {
+        for (unsigned i = 0; i < groups.Size(); ++i)
+            checkObjects(groups[i], "group");
+    }
+
+    if (instances.IsNull() || !checkTuple(instances, "instances", 0))
+        return;
+
+    for (unsigned i = 0; i < instances.Size(); ++i) {
+        const Value &instance = instances[i];
+        if (!checkTuple(instance, "instance", 5))
+            continue;
+
+        if (!instance[0u].IsUint() || !groups.IsArray() || instance[0u].GetUint() >= groups.Size())
+            mError << "Instance #" << i << " does not name a valid group\n";
+    }
+}
+
 bool ZRender::checkMaterialValue(int index)
 {
     const Value &v = mMaterials[index];
@@ -219,10 +497,13 @@ bool ZRender::checkMaterialValue(int index)
     return result;
 }
 
-const ZRender::Value& ZRender::chooseLight(Sampler &s)
+unsigned ZRender::chooseLight(Sampler &s)
 {
     // Pick a random light, using the light power as a probability weight.
-    // Fast path for scenes with only one light.
+    // Fast path for scenes with only one light, and for scenes with an alias table.
+
+    if (!mLightTable.empty())
+        return mLightTable.sample(s.uniform());
 
     unsigned i = 0;
     unsigned last = mLights.Size() - 1;
@@ -233,15 +514,15 @@ const ZRender::Value& ZRender::chooseLight(Sampler &s)
 
         // Check all lights except the last
         do {
-            const Value& light = mLights[i++];
-            sum += s.value(light[0u]);
+            sum += s.value(mLights[i][0u]);
             if (r <= sum)
-                return light;
+                return i;
+            i++;
         } while (i != last);
     }
 
     // Default, last light.
-    return mLights[last];
+    return last;
 }
 
 void ZRender::interrupt()
@@ -263,7 +544,23 @@ uint64_t ZRender::traceRays()
 
     uint64_t rayCount = 0;
     uint32_t seed = mSeed;
-    double startTime = (double)time(0);
+    Timer timer;
+
+    /*
+     * With a noise limit, rays are traced in rounds of consecutive seeds. Each
+     * round is an independent sample of the image, which NoiseEstimate uses to
+     * judge how converged each tile is. The first round runs until it has drawn
+     * enough segments that the per-round image scan is cheap by comparison, and
+     * every later round uses the same number of rays.
+     */
+
+    NoiseEstimate noise;
+    uint64_t roundRays = 0;
+    uint64_t roundStart = 0;
+    uint64_t roundStartSegments = mStats.segments;
+    uint64_t minRoundSegments = std::max<uint64_t>(1000, uint64_t(width()) * height() / 16);
+    if (mNoiseLimit)
+        noise.begin(mImage);
 
     while (1) {
         // Minimum frequency for checking stopping conditions
@@ -278,17 +575,69 @@ uint64_t ZRender::traceRays()
 
         if (mTimeLimit) {
             // Check time limit
-            double now = (double)time(0);
-            if (now > startTime + mTimeLimit)
+            double elapsed = timer.elapsed();
+            double remaining = mTimeLimit - elapsed;
+            if (remaining <= 0)
                 break;
+
+            /*
+             * Size the batch using the ray rate so far, so that we look at the
+             * clock every few milliseconds even when rays are slow, and never
+             * plan to run much past the deadline. The first ray is traced alone
+             * to get an initial estimate.
+             */
+
+            double rate = rayCount / elapsed;
+            double interval = std::min(remaining, kTimeCheckInterval);
+            batch = std::min<double>(batch, std::max(1.0, rate * interval));
+        }
+
+        if (roundRays) {
+            // Don't let a batch straddle two noise rounds
+            batch = std::min<uint64_t>(batch, roundStart + roundRays - rayCount);
         }
 
         traceRayBatch(seed, batch);
 
         seed += batch;
         rayCount += batch;
+
+        if (mProgress) {
+            // How far along the ray or time budget are we, if there is one?
+            double elapsed = timer.elapsed();
+            double fraction = -1;
+            if (mRayLimit > 0)
+                fraction = rayCount / mRayLimit;
+            if (mTimeLimit > 0)
+                fraction = std::max(fraction, elapsed / mTimeLimit);
+            mProgress->update(rayCount, elapsed, fraction);
+        }
+
+        if (mNoiseLimit) {
+            bool endOfRound = roundRays
+                ? rayCount - roundStart >= roundRays
+                : mStats.segments - roundStartSegments >= minRoundSegments;
+
+            if (endOfRound) {
+                if (!roundRays)
+                    roundRays = rayCount - roundStart;
+                roundStart = rayCount;
+
+                noise.addRound(mImage);
+                mStats.noiseRounds = noise.rounds();
+
+                if (noise.rounds() >= kMinNoiseRounds) {
+                    mStats.noise = noise.error(kNoisePercentile);
+                    if (mStats.noise <= mNoiseLimit)
+                        break;
+                }
+            }
+        }
     }
 
+    if (mProgress)
+        mProgress->finish(rayCount, timer.elapsed());
+
     return rayCount;
 }
 
@@ -301,11 +650,25 @@ void ZRender::traceRayBatch(uint32_t seed, uint32_t count)
      * Note that each ray is seeded separately, so that rays are independent events
      * with respect to the PRNG sequence. This helps keep our noise pattern stationary,
      * which is a nice effect to have during animation.
+     *
+     * Seeding is a large share of the cost of a short ray, so generators are
+     * seeded a group at a time. This gives each ray the same state as
+     * Sampler(seed) would.
      */
 
-    while (count--) {
-        Sampler s(seed++);
-        traceRay(s);
+    PRNG lanes[PRNG::kLanes];
+
+    while (count) {
+        uint32_t n = std::min<uint32_t>(count, PRNG::kLanes);
+        PRNG::seedLanes(lanes, seed);
+
+        for (uint32_t i = 0; i != n; ++i) {
+            Sampler s(lanes[i], seed + i);
+            traceRay(s);
+        }
+
+        seed += n;
+        count -= n;
     }
 }
 
@@ -313,30 +676,55 @@ void ZRender::traceRay(Sampler &s)
 {
     IntersectionData d;
     d.object = 0;
+    d.id = IntersectionData::kNoObject;
 
     double w = width();
     double h = height();
 
+    // Optionally, emit rays using the Sobol sequence
+    if (mSobol)
+        s.beginSobol();
+
     // Initialize the ray by sampling a light
-    if (!initRay(s, d.ray, chooseLight(s)))
+    if (!initRay(s, d.ray, chooseLight(s))) {
+        HQZ_COUNT(mStats.counters.raysRejected);
         return;
+    }
+
+    HQZ_COUNT(mStats.counters.raysEmitted);
 
     // Sample the viewport once per ray. (e.g. for camera motion blur)
     ViewportSample v;
     initViewport(s, v);
 
+    // Bounces use the PRNG
+    s.endSobol();
+
+    // Brightness relative to the emitted ray, after Russian roulette
+    Color emitted = d.ray.color;
+    double weight = 1.0;
+
     // Look for a large but bounded number of bounces
-    for (unsigned bounces = 1000; bounces; --bounces) {
+    for (unsigned bounces = mMaxBounces; ; ) {
 
         // Intersect with an object or the edge of the viewport
+        uint64_t tests = mHeatmapEnabled ? mQuadtree.tests() + mGroups.tests() : 0;
         bool hit = rayIntersect(d, s, v);
 
         // Draw a line from d.ray.origin to d.point
-        mImage.line( d.ray.color,
-            v.xScale(d.ray.origin.x, w),
-            v.yScale(d.ray.origin.y, h),
-            v.xScale(d.point.x, w),
-            v.yScale(d.point.y, h));
+        double x0 = v.xScale(d.ray.origin.x, w);
+        double y0 = v.yScale(d.ray.origin.y, h);
+        double x1 = v.xScale(d.point.x, w);
+        double y1 = v.yScale(d.point.y, h);
+
+        mStats.segments++;
+        mImage.line(d.ray.color, x0, y0, x1, y1);
+
+        if (mHeatmapEnabled) {
+            int cost = mQuadtree.tests() + mGroups.tests() - tests;
+            Color c = { cost, cost, cost };
+            mHeatmap.line(c, x0, y0, x1, y1);
+        }
 
         if (!hit) {
             // Ray exited the scene after this.
@@ -347,11 +735,46 @@ void ZRender::traceRay(Sampler &s)
             // Ray was absorbed by material
             break;
         }
+
+        s.mBounce++;
+
+        if (!--bounces) {
+            // Give up on this path
+            mStats.bounceLimitHits++;
+            break;
+        }
+
+        if (mRouletteDepth && s.mBounce >= mRouletteDepth &&
+            weight < kRouletteMaxWeight * kRouletteSurvival) {
+
+            if (s.uniform() >= kRouletteSurvival) {
+                // Terminated, without bias: survivors carry its light.
+                mStats.rouletteKills++;
+                break;
+            }
+
+            weight /= kRouletteSurvival;
+            d.ray.color.r = lround(emitted.r * weight);
+            d.ray.color.g = lround(emitted.g * weight);
+            d.ray.color.b = lround(emitted.b * weight);
+        }
     }
+
+    HQZ_COUNT(mStats.counters.bounces[bounceBucket(s.mBounce)]);
 }
 
-bool ZRender::initRay(Sampler &s, Ray &r, const Value &light)
+unsigned ZRender::bounceBucket(uint32_t bounces)
 {
+    // Power-of-two histogram buckets, as described in Stats::Counters.
+
+    unsigned bucket = bounces ? 32 - __builtin_clz(bounces) : 0;
+    return std::min(bucket, Stats::Counters::kBounceBuckets - 1);
+}
+
+bool ZRender::initRay(Sampler &s, Ray &r, unsigned lightIndex)
+{
+    const Value &light = mLights[lightIndex];
+
     double cartesianX = s.value(light[1]);
     double cartesianY = s.value(light[2]);
     double polarAngle = s.value(light[3]) * (M_PI / 180.0);
@@ -362,6 +785,24 @@ bool ZRender::initRay(Sampler &s, Ray &r, const Value &light)
     double rayAngle = s.value(light[5]) * (M_PI / 180.0);
     r.setAngle(rayAngle);
 
+    const LightSpectrum &spectrum = mLightSpectra[lightIndex];
+    switch (spectrum.mode) {
+
+        case LightSpectrum::kConstant:
+            r.color = spectrum.color;
+            return true;
+
+        case LightSpectrum::kTable:
+            r.color.setWavelength(mSpectra[spectrum.table].sample(s.uniform()));
+            return true;
+
+        case LightSpectrum::kInvisible:
+            return false;
+
+        case LightSpectrum::kRejection:
+            break;
+    }
+
     /*
      * Try to discard rays for invisible wavelengths without actually
      * counting them as real rays. (If we count them without tracing them,
@@ -444,6 +885,13 @@ bool ZRender::rayMaterial(IntersectionData &d, Sampler &s)
     unsigned id = object[0u].GetUint();
     const Value &material = mMaterials[id];
 
+    const AliasTable &table = mMaterialTables[id];
+    if (!table.empty()) {
+        // Constant-time lookup. The extra last entry means the ray is absorbed.
+        unsigned i = table.sample(s.uniform());
+        return i < material.Size() && ZMaterial::rayOutcome(material[i], d, s);
+    }
+
     double r = s.uniform();
     double sum = 0;
 
@@ -32,6 +32,10 @@
 #include "ray.h"
 #include "sampler.h"
 #include "zquadtree.h"
+#include "zgroups.h"
+#include "aliastable.h"
+#include "spectrum.h"
+#include "zprogress.h"
 #include <sstream>
 #include <vector>
 
@@ -40,12 +44,92 @@ class ZRender {
 public:
     typedef rapidjson::Value Value;
 
+    /*
+     * Bump this whenever the same scene would render a different image, so
+     * frames cached by an older renderer (see ZCache) are no longer used.
+     */
+    static const uint32_t kRendererVersion = 1;
+
     ZRender(const Value &scene);
 
     void render(std::vector<unsigned char> &pixels);
     void interrupt();
 
-    const char *errorText() const { return mError.str().c_str(); }
+    // Report progress while tracing rays. Optional; not owned by us.
+    void setProgress(ZProgress *progress) { mProgress = progress; }
+
+    /*
+     * Trace rays without tone mapping. Afterwards, histogram() holds the raw
+     * sample counts, and scale() and exponent() are the parameters render()
+     * would have used to map them to 8-bit color.
+     */
+    void renderHistogram();
+    const HistogramImage &histogram() const { return mImage; }
+    double scale() const { return mScale; }
+    double exponent() const { return mExponent; }
+
+    // The second half of render(), for a histogram that's already traced.
+    void toneMap(std::vector<unsigned char> &pixels);
+
+    /*
+     * Split one frame between several renderers, each built from its own copy
+     * of the scene. Before rendering, splitRays() gives this renderer its share
+     * of the scene's seed range. It returns false if the scene can't be split:
+     * only a plain ray limit says in advance which rays make up the image.
+     * After each part is traced with renderHistogram(), merge() them all into
+     * one renderer and toneMap() it. The image is the same as rendering the
+     * frame in one piece.
+     */
+    bool splitRays(unsigned part, unsigned parts);
+    void merge(const ZRender &part);
+
+    /*
+     * Optionally, also draw each segment into a heatmap, with a brightness
+     * proportional to the object intersection tests it took to find. Call
+     * enableHeatmap() before rendering, and heatmap() after.
+     */
+    void enableHeatmap();
+    void heatmap(std::vector<unsigned char> &pixels);
+
+    // Throughput and timing from the last render. Times are in seconds.
+    struct Stats {
+        uint64_t rays;
+        uint64_t segments;
+        double buildTime;
+        double traceTime;
+        double toneMapTime;
+
+        // Noise estimate, as a fraction of tile brightness. Only when "noise" is set.
+        double noise;
+        unsigned noiseRounds;
+
+        // Paths cut off by "maxbounces", and paths ended by Russian roulette.
+        uint64_t bounceLimitHits;
+        uint64_t rouletteKills;
+
+        ZQuadtree::Report quadtree;
+
+        // Hot-path counters. These stay zero unless built with HQZ_STATS,
+        // except for intersectionTests.
+        struct Counters {
+            uint64_t raysEmitted;
+            uint64_t raysRejected;          // Light had no visible wavelengths
+            uint64_t nodesVisited;
+            uint64_t intersectionTests;
+            uint64_t hits;                  // Any object hit, not just the closest
+            uint64_t segmentsRasterized;
+            uint64_t segmentsClipped;       // Entirely outside the image
+
+            // Rays by number of bounces: bucket 0 is no bounces, bucket k > 0 is
+            // [2^(k-1), 2^k - 1] bounces, and the last bucket is open-ended.
+            static const unsigned kBounceBuckets = 16;
+            uint64_t bounces[kBounceBuckets];
+        } counters;
+    };
+
+    const Stats &stats() const { return mStats; }
+
+    const char *errorText() const { mErrorText = mError.str(); return mErrorText.c_str(); }
     bool hasError() const { return !mError.str().empty(); }
     unsigned width() const { return mImage.width(); }
     unsigned height() const { return mImage.height(); }
@@ -53,8 +137,33 @@ public:
 private:
     static const uint32_t kDebugQuadtree = 1 << 0;
 
+    // Minimum list length for which we build alias tables
+    static const unsigned kAliasThreshold = 8;
+
+    // Bounce limit when the scene doesn't set "maxbounces"
+    static const unsigned kDefaultMaxBounces = 1000;
+
     HistogramImage mImage;
+    HistogramImage mHeatmap;
     ZQuadtree mQuadtree;
+    ZGroups mGroups;
+    AliasTable mLightTable;
+    std::vector<AliasTable> mMaterialTables;
+
+    // How each light picks a wavelength. Parallel to mLights.
+    struct LightSpectrum {
+        enum Mode {
+            kRejection,     // Unrecognized distribution; sample and retry
+            kConstant,      // Single visible wavelength, in 'color'
+            kTable,         // Visible part of a distribution, in mSpectra[table]
+            kInvisible,     // No visible light at all
+        } mode;
+        Color color;
+        unsigned table;
+    };
+
+    std::vector<LightSpectrum> mLightSpectra;
+    std::vector<VisibleSpectrum> mSpectra;
 
     const Value& mScene;
     const Value& mViewport;
@@ -63,12 +172,22 @@ private:
     const Value& mMaterials;
 
     uint32_t mSeed;
+    bool mSobol;
     double mLightPower;
     uint32_t mDebug;
+    bool mHeatmapEnabled;
+    ZProgress *mProgress;
+    uint32_t mMaxBounces;
+    uint32_t mRouletteDepth;
     double mRayLimit;
     double mTimeLimit;
+    double mNoiseLimit;
+    double mScale;
+    double mExponent;
+    Stats mStats;
 
     std::ostringstream mError;
+    mutable std::string mErrorText;
 
     struct ViewportSample {
         Vec2 origin;
@@ -89,15 +208,23 @@ private:
     double checkNumber(const Value &v, const char *noun);
     bool checkMaterialID(const Value &v);
     bool checkMaterialValue(int index);
+    void checkObjects(const Value &objects, const char *noun);
+    void checkInstances(const Value &groups, const Value &instances);
 
     // Raytracer entry point
     void traceRay(Sampler &s);
+    void updateScale();
+    static unsigned bounceBucket(uint32_t bounces);
     void traceRayBatch(uint32_t seed, uint32_t count);
     uint64_t traceRays();
 
+    // Sampling setup
+    void initAliasTables();
+    void initLightSpectra();
+
     // Light sampling
-    const Value &chooseLight(Sampler &s);
-    bool initRay(Sampler &s, Ray &r, const Value &light);
+    unsigned chooseLight(Sampler &s);
+    bool initRay(Sampler &s, Ray &r, unsigned light);
     void initViewport(Sampler &s, ViewportSample &v);
 
     // Material sampling
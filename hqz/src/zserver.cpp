@@ -0,0 +1,262 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "zserver.h"
+#include "scenefile.h"
+#include "zrender.h"
+#include "lodepng.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+ZServer::ZServer(const char *path, unsigned slots, const char *cacheDir)
+    : mPath(path), mSlots(slots), mCache(cacheDir ? new ZCache(cacheDir) : 0)
+{
+    pthread_mutex_init(&mLock, 0);
+    pthread_cond_init(&mReady, 0);
+}
+
+int ZServer::run()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+
+    if (mPath.size() >= sizeof addr.sun_path) {
+        fprintf(stderr, "Socket path is too long: %s\n", mPath.c_str());
+        return 3;
+    }
+    strcpy(addr.sun_path, mPath.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("Error creating socket");
+        return 3;
+    }
+
+    // Replace a stale socket left behind by an earlier server, but nothing else.
+    struct stat st;
+    if (stat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(addr.sun_path);
+
+    if (bind(listener, (struct sockaddr*) &addr, sizeof addr) < 0 || listen(listener, SOMAXCONN) < 0) {
+        perror("Error listening on socket");
+        return 3;
+    }
+
+    // Clients that hang up early shouldn't take the whole server with them.
+    signal(SIGPIPE, SIG_IGN);
+
+    for (unsigned i = 0; i < mSlots.size(); ++i) {
+        mSlots[i].server = this;
+        mSlots[i].index = i;
+        if (pthread_create(&mSlots[i].thread, 0, worker, &mSlots[i])) {
+            perror("Error creating worker thread");
+            return 3;
+        }
+    }
+
+    fprintf(stderr, "Listening on %s with %d job slots\n", mPath.c_str(), (int)mSlots.size());
+
+    for (;;) {
+        int fd = accept(listener, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Error accepting connection");
+            return 3;
+        }
+
+        pthread_mutex_lock(&mLock);
+        mConnections.push_back(fd);
+        pthread_cond_signal(&mReady);
+        pthread_mutex_unlock(&mLock);
+    }
+}
+
+void *ZServer::worker(void *arg)
+{
+    Slot &slot = *(Slot*) arg;
+    slot.server->mAffinity.pin(slot.index);
+
+    for (;;) {
+        int fd = slot.server->nextConnection();
+        slot.server->serveConnection(slot, fd);
+        close(fd);
+    }
+
+    return 0;
+}
+
+int ZServer::nextConnection()
+{
+    pthread_mutex_lock(&mLock);
+    while (mConnections.empty())
+        pthread_cond_wait(&mReady, &mLock);
+    int fd = mConnections.front();
+    mConnections.pop_front();
+    pthread_mutex_unlock(&mLock);
+    return fd;
+}
+
+void ZServer::serveConnection(Slot &slot, int fd)
+{
+    /*
+     * Handle requests on this connection until the client closes it,
+     * or until something goes wrong badly enough that we can't stay in sync.
+     */
+
+    for (;;) {
+        RequestHeader request;
+        if (!readAll(fd, &request, sizeof request))
+            return;
+
+        ResponseHeader response;
+        memcpy(response.magic, "HQZA", sizeof response.magic);
+
+        if (memcmp(request.magic, "HQZQ", sizeof request.magic) || request.length > kMaxSceneSize) {
+            static const char message[] = "Bad request header\n";
+            response.status = 1;
+            response.length = sizeof message - 1;
+            writeAll(fd, &response, sizeof response);
+            writeAll(fd, message, response.length);
+            return;
+        }
+
+        // The scene buffer is reused between jobs, and parsed in-situ.
+        slot.scene.resize(request.length + 1);
+        if (!readAll(fd, &slot.scene[0], request.length))
+            return;
+        slot.scene[request.length] = '\0';
+
+        response.status = renderJob(slot, request.flags);
+
+        const void *payload;
+        if (response.status) {
+            payload = slot.error.data();
+            response.length = slot.error.size();
+        } else {
+            payload = slot.output.empty() ? 0 : &slot.output[0];
+            response.length = slot.output.size();
+        }
+
+        if (!writeAll(fd, &response, sizeof response) || !writeAll(fd, payload, response.length))
+            return;
+    }
+}
+
+uint32_t ZServer::renderJob(Slot &slot, uint32_t flags)
+{
+    // Returns a status code matching the hqz command line. Output goes to slot.output.
+
+    slot.output.clear();
+    slot.error.clear();
+
+    SceneFile sceneFile;
+    sceneFile.parse(&slot.scene[0], slot.scene.size() - 1);
+    if (sceneFile.hasError()) {
+        slot.error = sceneFile.errorText();
+        return 4;
+    }
+
+    const char *kind = (flags & kHistogram) ? "hist" : "png";
+    uint64_t key = 0;
+    if (mCache) {
+        key = ZCache::key(sceneFile.document());
+        if (mCache->load(key, kind, slot.output))
+            return 0;
+    }
+
+    ZRender zr(sceneFile.document());
+    if (zr.hasError()) {
+        slot.error = std::string("Scene errors:\n") + zr.errorText();
+        return 5;
+    }
+
+    if (flags & kHistogram) {
+        zr.renderHistogram();
+
+        const HistogramImage &image = zr.histogram();
+        HistogramHeader header = { zr.width(), zr.height(), zr.scale(), zr.exponent() };
+        size_t countBytes = image.size() * sizeof image.counts()[0];
+
+        slot.output.resize(sizeof header + countBytes);
+        memcpy(&slot.output[0], &header, sizeof header);
+        memcpy(&slot.output[sizeof header], image.counts(), countBytes);
+
+    } else {
+        zr.render(slot.pixels);
+        lodepng::encode(slot.output, slot.pixels, zr.width(), zr.height(), LCT_RGB);
+    }
+
+    if (zr.hasError()) {
+        slot.error = std::string("Renderer errors:\n") + zr.errorText();
+        return 7;
+    }
+
+    if (mCache && !mCache->store(key, kind, &slot.output[0], slot.output.size()))
+        perror("Error writing to frame cache");
+
+    return 0;
+}
+
+bool ZServer::readAll(int fd, void *buffer, size_t length)
+{
+    char *p = (char*) buffer;
+    while (length) {
+        ssize_t count = read(fd, p, length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        p += count;
+        length -= count;
+    }
+    return true;
+}
+
+bool ZServer::writeAll(int fd, const void *buffer, size_t length)
+{
+    const char *p = (const char*) buffer;
+    while (length) {
+        ssize_t count = write(fd, p, length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        p += count;
+        length -= count;
+    }
+    return true;
+}
@@ -0,0 +1,116 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+#include "zcache.h"
+#include "affinity.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+
+/**
+ * Persistent render daemon, listening on a Unix domain socket.
+ *
+ * Clients send one or more framed requests over a connection, and get one
+ * framed response back for each, in order. All integers are native-endian,
+ * since both ends are always on the same machine:
+ *
+ *   Request:   RequestHeader, then 'length' bytes of scene (JSON or binary)
+ *   Response:  ResponseHeader, then 'length' bytes of payload
+ *
+ * On success the payload is a PNG file, or with kHistogram a HistogramHeader
+ * followed by the raw int64 sample counts. On failure, 'status' matches the exit
+ * status hqz would have returned for the same scene, and the payload is error text.
+ *
+ * Each job slot is a long-lived thread that serves one connection at a time,
+ * and keeps its scene, pixel and PNG buffers between jobs.
+ *
+ * With a cache directory, each payload is also saved there, and a job whose
+ * scene is already cached gets the saved payload without any rendering.
+ */
+
+class ZServer {
+public:
+    static const uint32_t kHistogram = 1 << 0;     // Request flag: return raw histogram, not PNG
+
+    struct RequestHeader {
+        char magic[4];          // "HQZQ"
+        uint32_t flags;
+        uint64_t length;
+    };
+
+    struct ResponseHeader {
+        char magic[4];          // "HQZA"
+        uint32_t status;
+        uint64_t length;
+    };
+
+    struct HistogramHeader {
+        uint32_t width;
+        uint32_t height;
+        double scale;           // Multiply counts by this before applying 'exponent'
+        double exponent;
+    };
+
+    // 'cacheDir' is optional; see ZCache
+    ZServer(const char *path, unsigned slots, const char *cacheDir = 0);
+    int run();
+
+private:
+    static const uint64_t kMaxSceneSize = 1ULL << 32;
+
+    struct Slot {
+        ZServer *server;
+        unsigned index;
+        pthread_t thread;
+        std::vector<char> scene;
+        std::vector<unsigned char> pixels;
+        std::vector<unsigned char> output;
+        std::string error;
+    };
+
+    std::string mPath;
+    std::vector<Slot> mSlots;
+    ZCache *mCache;
+    Affinity mAffinity;
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mReady;
+    std::deque<int> mConnections;
+
+    static void *worker(void *arg);
+    int nextConnection();
+    void serveConnection(Slot &slot, int fd);
+    uint32_t renderJob(Slot &slot, uint32_t flags);
+
+    static bool readAll(int fd, void *buffer, size_t length);
+    static bool writeAll(int fd, const void *buffer, size_t length);
+};